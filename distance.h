@@ -0,0 +1,223 @@
+#pragma once
+
+#include <math.h>
+
+#include <functional>
+
+#include "numxd.h"
+
+// Pairwise distances between the rows of two sets (cdist) or within one set (pdist), scipy style.
+// The result is computed in tiles of TileRows x TileCols so the rows of both sides stay in cache; the inner
+// loops are unrolled per column count with FixedDim-like code so the compiler can vectorize them.
+// Cosine distance is 1 - a.b / (|a| |b|); a zero vector is treated as orthogonal to everything (distance 1).
+enum DistanceMetric {
+    MetricEuclidean,
+    MetricSquaredEuclidean,
+    MetricCosine,
+    MetricManhattan,
+};
+
+namespace Distance {
+    const int TileRows = 32;
+    const int TileCols = 256;
+
+    // One tile of the result: Value[i * Stride + j] is the distance of row RowStart + i to row ColStart + j.
+    template <typename T>
+    class Tile {
+        public:
+        long int RowStart;
+        long int ColStart;
+        int Rows;
+        int Cols;
+        long int Stride;
+        const T* Value;
+    };
+
+    template <typename T, int D, int Metric>
+    class Kernel {
+        public:
+        template <size_t... I>
+        static T Unrolled(const T* a, const T* b, std::index_sequence<I...>) {
+            T total = 0;
+            if constexpr (Metric == MetricManhattan) {
+                ((total += fabs(a[I] - b[I])), ...);
+            } else if constexpr (Metric == MetricCosine) {
+                ((total += a[I] * b[I]), ...);
+            } else {
+                T d[sizeof...(I)] = {(a[I] - b[I])...};
+                ((total += d[I] * d[I]), ...);
+            }
+            return total;
+        }
+        // Sum over the columns: |a - b| for Manhattan, a.b for Cosine, (a - b)^2 otherwise.
+        static T Accumulate(const T* a, const T* b, int col) {
+            if constexpr (D != Dynamic) {
+                return Unrolled(a, b, std::make_index_sequence<D>());
+            } else {
+                T total = 0;
+                for(int n = 0; n < col; n += 1) {
+                    if constexpr (Metric == MetricManhattan) {
+                        total += fabs(a[n] - b[n]);
+                    } else if constexpr (Metric == MetricCosine) {
+                        total += a[n] * b[n];
+                    } else {
+                        T d = a[n] - b[n];
+                        total += d * d;
+                    }
+                }
+                return total;
+            }
+        }
+        static T Finish(T total, T normA, T normB) {
+            if constexpr (Metric == MetricEuclidean) {
+                return sqrt(total);
+            } else if constexpr (Metric == MetricCosine) {
+                return (normA > 0 && normB > 0) ? std::max((T)0, 1 - total / (normA * normB)) : 1;
+            } else {
+                return total;
+            }
+        }
+
+        // out[i * stride + j] for a rows [0, rowsA) against b rows [0, rowsB).
+        static void Block(const T* a, long int rowsA, const T* normA, const T* b, long int rowsB, const T* normB, int col, T* out, long int stride) {
+            for(long int i = 0; i < rowsA; i += 1) {
+                const T* rowA = a + i * col;
+                T* dst = out + i * stride;
+                for(long int j = 0; j < rowsB; j += 1) {
+                    T total = Accumulate(rowA, b + j * col, col);
+                    dst[j] = Finish(total, (normA == NULL) ? 0 : normA[i], (normB == NULL) ? 0 : normB[j]);
+                }
+            }
+        }
+    };
+
+    // Euclidean norms of the rows, only Cosine needs them.
+    template <typename T>
+    std::vector<T> Norms(const T* x, long int rows, int col, int metric) {
+        std::vector<T> norms;
+        if(metric == MetricCosine) {
+            norms.resize(rows);
+            for(long int i = 0; i < rows; i += 1) {
+                T total = 0;
+                for(int n = 0; n < col; n += 1) {
+                    total += x[i * col + n] * x[i * col + n];
+                }
+                norms[i] = sqrt(total);
+            }
+        }
+        return norms;
+    }
+
+    template <typename T, int D, int Metric>
+    void Tiles(const T* a, const T* normA, const T* b, long int rowsB, const T* normB, int col,
+        long int rowStart, long int rowEnd, T* out, long int stride, const std::function<void(const Tile<T>&)>* callback, bool upper) {
+        std::vector<T> buffer;
+        if(callback != NULL) {
+            buffer.resize((size_t)TileRows * TileCols);
+        }
+        for(long int i = rowStart; i < rowEnd; i += TileRows) {
+            int rows = std::min((long int)TileRows, rowEnd - i);
+            // upper skips the tiles left of the first column above the diagonal
+            for(long int j = upper ? (i + 1) / TileCols * TileCols : 0; j < rowsB; j += TileCols) {
+                int cols = std::min((long int)TileCols, rowsB - j);
+                const T* na = (normA == NULL) ? NULL : normA + i;
+                const T* nb = (normB == NULL) ? NULL : normB + j;
+                if(callback == NULL) {
+                    Kernel<T, D, Metric>::Block(a + i * col, rows, na, b + j * col, cols, nb, col, out + i * stride + j, stride);
+                } else {
+                    Kernel<T, D, Metric>::Block(a + i * col, rows, na, b + j * col, cols, nb, col, buffer.data(), TileCols);
+                    Tile<T> tile = {i, j, rows, cols, TileCols, buffer.data()};
+                    (*callback)(tile);
+                }
+            }
+        }
+    }
+
+    template <typename T>
+    void Run(const T* a, long int rowsA, const T* b, long int rowsB, int col, int metric,
+        T* out, long int stride, const std::function<void(const Tile<T>&)>* callback, int threads, bool upper = false) {
+        if(metric < MetricEuclidean || metric > MetricManhattan) {
+            throw Format("error in %s: %d, unknown metric %d", __FUNCTION__, __LINE__, metric);
+        }
+        auto normA = Norms(a, rowsA, col, metric);
+        auto normB = (b == a) ? normA : Norms(b, rowsB, col, metric);
+        const T* na = normA.empty() ? NULL : normA.data();
+        const T* nb = normB.empty() ? NULL : normB.data();
+        DispatchDim(col, [&](auto dim) {
+            const int D = decltype(dim)::value;
+            // a chunk of rows is at least one tile and at least Parallel::MinWork pairs
+            long int grain = std::max((long int)TileRows, Parallel::MinWork / std::max(1L, rowsB));
+            Parallel::ParallelFor(0, rowsA, grain, [&](long int start, long int end) {
+                switch(metric) {
+                    case MetricEuclidean: Tiles<T, D, MetricEuclidean>(a, na, b, rowsB, nb, col, start, end, out, stride, callback, upper); break;
+                    case MetricSquaredEuclidean: Tiles<T, D, MetricSquaredEuclidean>(a, na, b, rowsB, nb, col, start, end, out, stride, callback, upper); break;
+                    case MetricCosine: Tiles<T, D, MetricCosine>(a, na, b, rowsB, nb, col, start, end, out, stride, callback, upper); break;
+                    case MetricManhattan: Tiles<T, D, MetricManhattan>(a, na, b, rowsB, nb, col, start, end, out, stride, callback, upper); break;
+                }
+            }, threads);
+        });
+    }
+
+    template <typename T>
+    void CheckShapes(Num2D<T> a, Num2D<T> b) {
+        if(CheckLevel >= 1 && a.Col != b.Col) {
+            throw Format("error in %s: %d, different Num2D::Col %ld != %ld", __FUNCTION__, __LINE__, a.Col, b.Col);
+        }
+    }
+
+    ////////////////////////////////////////
+    // cdist
+    ////////////////////////////////////////
+    // Writes into the caller's out (a.Row x b.Row); nothing else is allocated but the cosine norms.
+    template <typename T>
+    void CDist(Num2D<T> a, Num2D<T> b, int metric, Num2D<T> out, int threads = 0) {
+        CheckShapes(a, b);
+        if(CheckLevel >= 1 && (out.Row != a.Row || out.Col != b.Row)) {
+            throw Format("error in %s: %d, output is (%ld, %ld), expected (%ld, %ld)", __FUNCTION__, __LINE__, out.Row, out.Col, a.Row, b.Row);
+        }
+        Run<T>(a.Value, a.Row, b.Value, b.Row, a.Col, metric, out.Value, out.Col, NULL, threads);
+    }
+
+    template <typename T>
+    Num2D<T> CDist(MemoryManager& mm, Num2D<T> a, Num2D<T> b, int metric, int threads = 0) {
+        Num2D<T> n2d(mm);
+        auto out = n2d.Create(a.Row, b.Row);
+        CDist(a, b, metric, out, threads);
+        return out;
+    }
+
+    // Streams the result tile by tile, the full a.Row x b.Row matrix never exists.
+    // With threads > 1 callback is called concurrently from the worker threads, each with its own tile.
+    template <typename T>
+    void CDistTiles(Num2D<T> a, Num2D<T> b, int metric, std::function<void(const Tile<T>&)> callback, int threads = 0) {
+        CheckShapes(a, b);
+        Run<T>(a.Value, a.Row, b.Value, b.Row, a.Col, metric, (T*)NULL, 0, &callback, threads);
+    }
+
+    ////////////////////////////////////////
+    // pdist
+    ////////////////////////////////////////
+    // Condensed distances of x with itself like scipy.spatial.distance.pdist:
+    // the pair i < j is at x.Row * i - i * (i + 1) / 2 + j - i - 1. Tiles entirely below the diagonal are skipped.
+    template <typename T>
+    Num1D<T> PDist(MemoryManager& mm, Num2D<T> x, int metric, int threads = 0) {
+        const long int rows = x.Row;
+        Num1D<T> n1d(mm);
+        auto out = n1d.Create(rows * (rows - 1) / 2);
+        T* value = out.Value;
+        std::function<void(const Tile<T>&)> callback = [=](const Tile<T>& tile) {
+            for(int i = 0; i < tile.Rows; i += 1) {
+                long int m = tile.RowStart + i;
+                long int base = rows * m - m * (m + 1) / 2 - m - 1;
+                for(int j = 0; j < tile.Cols; j += 1) {
+                    long int n = tile.ColStart + j;
+                    if(n > m) {
+                        value[base + n] = tile.Value[i * tile.Stride + j];
+                    }
+                }
+            }
+        };
+        Run<T>(x.Value, rows, x.Value, rows, x.Col, metric, (T*)NULL, 0, &callback, threads, true);
+        return out;
+    }
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <limits>
+
+#include "numxd.h"
+
+// k-d tree over a small set of points (the centroids of a model), for nearest point queries in O(log K)
+// instead of a scan over all K. The points are copied in leaf order so a leaf is one contiguous block.
+// Epsilon > 0 makes the search approximate: a subtree is skipped unless it may hold a point closer than
+// best / (1 + Epsilon), so the answer is within (1 + Epsilon) of the true distance and far fewer leaves are visited.
+template <typename T>
+class KDTree {
+    public:
+    int Count;
+    int Col;
+    int LeafSize;
+    double Epsilon;
+    std::vector<T> Points;
+    std::vector<int> Index;
+    // node i: leaf when SplitDim[i] < 0, then it holds Points rows [Begin[i], End[i])
+    std::vector<int> SplitDim;
+    std::vector<T> SplitValue;
+    std::vector<int> Left;
+    std::vector<int> Right;
+    std::vector<int> Begin;
+    std::vector<int> End;
+    KDTree(): Count(0), Col(0), LeafSize(8), Epsilon(0) {}
+
+    bool Built() const {
+        return this->Count > 0;
+    }
+    void Clear() {
+        *this = KDTree();
+    }
+
+    void Build(const T* points, int count, int col, double epsilon = 0, int leafSize = 8) {
+        if(count <= 0 || col <= 0 || leafSize <= 0) {
+            throw Format("error in %s: %d, cannot build a tree over (%d, %d) with leaf size %d", __FUNCTION__, __LINE__, count, col, leafSize);
+        }
+        this->Clear();
+        this->Count = count;
+        this->Col = col;
+        this->LeafSize = leafSize;
+        this->Epsilon = epsilon;
+        this->Index.resize(count);
+        for(int i = 0; i < count; i += 1) {
+            this->Index[i] = i;
+        }
+        this->BuildNode(points, 0, count);
+        this->Points.resize((size_t)count * col);
+        for(int i = 0; i < count; i += 1) {
+            memcpy(&this->Points[(size_t)i * col], points + (size_t)this->Index[i] * col, sizeof(T) * col);
+        }
+    }
+
+    // Splits [begin, end) of Index at the median of the widest dimension.
+    int BuildNode(const T* points, int begin, int end) {
+        int node = this->SplitDim.size();
+        this->SplitDim.push_back(-1);
+        this->SplitValue.push_back(0);
+        this->Left.push_back(-1);
+        this->Right.push_back(-1);
+        this->Begin.push_back(begin);
+        this->End.push_back(end);
+        if(end - begin <= this->LeafSize) {
+            return node;
+        }
+        int dim = 0;
+        T widest = -1;
+        for(int n = 0; n < this->Col; n += 1) {
+            T low = points[(size_t)this->Index[begin] * this->Col + n];
+            T high = low;
+            for(int i = begin + 1; i < end; i += 1) {
+                T value = points[(size_t)this->Index[i] * this->Col + n];
+                low = std::min(low, value);
+                high = std::max(high, value);
+            }
+            if(high - low > widest) {
+                widest = high - low;
+                dim = n;
+            }
+        }
+        int middle = begin + (end - begin) / 2;
+        const int col = this->Col;
+        std::nth_element(this->Index.begin() + begin, this->Index.begin() + middle, this->Index.begin() + end, [&](int a, int b) {
+            return points[(size_t)a * col + dim] < points[(size_t)b * col + dim];
+        });
+        this->SplitDim[node] = dim;
+        this->SplitValue[node] = points[(size_t)this->Index[middle] * col + dim];
+        int left = this->BuildNode(points, begin, middle);
+        int right = this->BuildNode(points, middle, end);
+        this->Left[node] = left;
+        this->Right[node] = right;
+        return node;
+    }
+
+    ////////////////////////////////////////
+    // search
+    ////////////////////////////////////////
+    // Index of the nearest point and its squared distance. Reentrant and allocation-free;
+    // D is the compile-time column count as in FixedDim.
+    template <int D>
+    int Nearest(const T* query, T* squaredDistance) const {
+        FixedDim<T, D>::CheckDim(this->Col);
+        int best = -1;
+        T bestDistance = std::numeric_limits<T>::max();
+        const T scale = (T)(1 / ((1 + this->Epsilon) * (1 + this->Epsilon)));
+        this->Search<D>(0, query, scale, &best, &bestDistance);
+        if(squaredDistance != NULL) {
+            *squaredDistance = bestDistance;
+        }
+        return this->Index[best];
+    }
+
+    template <int D>
+    void Search(int node, const T* query, T scale, int* best, T* bestDistance) const {
+        if(this->SplitDim[node] < 0) {
+            for(int i = this->Begin[node]; i < this->End[node]; i += 1) {
+                T distance = FixedDim<T, D>::SquaredDistance(query, &this->Points[(size_t)i * this->Col], this->Col);
+                if(*best < 0 || distance < *bestDistance || (distance == *bestDistance && this->Index[i] < this->Index[*best])) {
+                    *bestDistance = distance;
+                    *best = i;
+                }
+            }
+            return;
+        }
+        T diff = query[this->SplitDim[node]] - this->SplitValue[node];
+        int nearChild = (diff < 0) ? this->Left[node] : this->Right[node];
+        int farChild = (diff < 0) ? this->Right[node] : this->Left[node];
+        this->Search<D>(nearChild, query, scale, best, bestDistance);
+        if(diff * diff <= *bestDistance * scale) {
+            this->Search<D>(farChild, query, scale, best, bestDistance);
+        }
+    }
+};
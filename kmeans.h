@@ -1,7 +1,168 @@
 
 #pragma once
 
+#include <chrono>
+#include <functional>
+#include <limits>
+
+#include "kdtree.h"
 #include "numxd.h"
+#include "quantize.h"
+#include "snapshot.h"
+#include "sparse.h"
+
+// Assignment and centroid update over rows of D features, D picked at runtime with DispatchDim.
+// For a fixed D the row is copied into a local array and every distance is straight-line code.
+template <typename T, int D>
+class KMeansKernel {
+    public:
+    // predict[i] is the nearest mean of row i and minDistance[i] (unless NULL) its squared distance.
+    // Returns the inertia, the total of the squared distances.
+    static T EStep(const T* means, int clusters, const T* x, long int rows, int col, Label* predict, T* minDistance) {
+        FixedDim<T, D>::CheckDim(col);
+        T local[D == Dynamic ? 1 : D];
+        T inertia = 0;
+        for(long int i = 0; i < rows; i += 1) {
+            const T* row = x + (long int)i * col;
+            if constexpr (D != Dynamic) {
+                for(int n = 0; n < D; n += 1) {
+                    local[n] = row[n];
+                }
+                row = local;
+            }
+            T best = FixedDim<T, D>::SquaredDistance(row, means, col);
+            Label bestIndex = 0;
+            for(int cluster = 1; cluster < clusters; cluster += 1) {
+                T distance = FixedDim<T, D>::SquaredDistance(row, means + (long int)cluster * col, col);
+                if(distance < best) {
+                    best = distance;
+                    bestIndex = cluster;
+                }
+            }
+            predict[i] = bestIndex;
+            inertia += best;
+            if(minDistance != NULL) {
+                minDistance[i] = best;
+            }
+        }
+        return inertia;
+    }
+    
+    // Nearest mean of one row, with the squared distances to it and to the second nearest (max() for one cluster).
+    static Label Nearest2(const T* means, int clusters, const T* row, int col, T* best, T* second) {
+        Label bestIndex = 0;
+        T first = std::numeric_limits<T>::max();
+        T next = std::numeric_limits<T>::max();
+        for(int cluster = 0; cluster < clusters; cluster += 1) {
+            T distance = FixedDim<T, D>::SquaredDistance(row, means + (long int)cluster * col, col);
+            // selects instead of branches, which cluster wins is unpredictable
+            bestIndex = (distance < first) ? cluster : bestIndex;
+            next = std::min(next, std::max(first, distance));
+            first = std::min(first, distance);
+        }
+        *best = first;
+        *second = next;
+        return bestIndex;
+    }
+    
+    // means (clusters x col) becomes the mean of the rows assigned to each cluster, counts their number.
+    static void MStep(const Label* predict, const T* x, long int rows, int col, int clusters, T* means, long int* counts) {
+        FixedDim<T, D>::CheckDim(col);
+        memset(means, 0, sizeof(T) * clusters * col);
+        memset(counts, 0, sizeof(long int) * clusters);
+        for(long int i = 0; i < rows; i += 1) {
+            FixedDim<T, D>::Add(means + (long int)predict[i] * col, x + (long int)i * col, col);
+            counts[predict[i]] += 1;
+        }
+        for(int cluster = 0; cluster < clusters; cluster += 1) {
+            for(int n = 0; n < col; n += 1) {
+                means[cluster * col + n] /= counts[cluster];
+            }
+        }
+    }
+};
+
+// What one Training iteration did. Inertia is measured against the means the E step assigned to,
+// Shift is CalcMeansDistance between those means and the ones the M step produced.
+class KMeansIteration {
+    public:
+    int Iteration;
+    double Shift;
+    double Inertia;
+    std::vector<long int> ClusterSizes;
+    // rows the E step computed distances for, every row in Training
+    long int Scanned;
+    double EStepSeconds;
+    double MStepSeconds;
+    KMeansIteration(): Iteration(0), Shift(0), Inertia(0), Scanned(0), EStepSeconds(0), MStepSeconds(0) {}
+};
+
+// Totals of the last Training call, always kept.
+class KMeansSummary {
+    public:
+    int Iterations;
+    bool Converged;
+    bool Stopped;
+    double Shift;
+    double Inertia;
+    int EmptyClusters;
+    double EStepSeconds;
+    double MStepSeconds;
+    double TotalSeconds;
+    KMeansSummary():
+        Iterations(0), Converged(false), Stopped(false), Shift(0), Inertia(0), EmptyClusters(0),
+        EStepSeconds(0), MStepSeconds(0), TotalSeconds(0) {}
+    
+    std::string Json() {
+        std::ostringstream os;
+        os << "{\"iterations\": " << this->Iterations << ", \"converged\": " << (this->Converged ? "true" : "false");
+        os << ", \"stopped\": " << (this->Stopped ? "true" : "false") << ", \"shift\": " << this->Shift;
+        os << ", \"inertia\": " << this->Inertia << ", \"empty_clusters\": " << this->EmptyClusters;
+        os << ", \"estep_seconds\": " << this->EStepSeconds << ", \"mstep_seconds\": " << this->MStepSeconds;
+        os << ", \"total_seconds\": " << this->TotalSeconds << "}";
+        return os.str();
+    }
+};
+
+// Per-row state KMeans::Refresh keeps between calls: the assignment of every row with its Hamerly bounds,
+// Upper at least the distance to the assigned centroid and Lower at most the distance to any other one,
+// and the running sums of every cluster, so a row whose bounds still hold is not looked at again.
+class KMeansWarmState {
+    public:
+    // Rows an E step moved, each with the cluster it left, and the number of rows it computed distances for.
+    class Moves {
+        public:
+        long int Scanned;
+        std::vector<std::pair<long int, Label>> Rows;
+        Moves(): Scanned(0) {}
+    };
+    
+    // Refresh recomputes the sums from the data when this many Refresh calls have only updated them.
+    static const int RebuildEvery = 16;
+
+    int Col;
+    std::vector<Label> Assign;
+    std::vector<double> Upper;
+    std::vector<double> Lower;
+    // The sums are taken around a reference point per cluster (clusters x Col, the means when the sums were last
+    // recomputed), so they stay small next to the data and the inertia does not cancel far from the origin:
+    // clusters x Col sums of row - reference of the assigned rows, the totals of their squared distances to the
+    // reference and their counts.
+    std::vector<double> References;
+    std::vector<double> Sums;
+    std::vector<double> SquaredDistances;
+    std::vector<long int> Counts;
+    // Refresh calls since the sums were recomputed
+    int Updates;
+    KMeansWarmState(): Col(0), Updates(0) {}
+    
+    long int Rows() const {
+        return this->Assign.size();
+    }
+    void Clear() {
+        *this = KMeansWarmState();
+    }
+};
 
 class KMeans {
     public:
@@ -12,19 +173,39 @@ class KMeans {
     const int Clusters;
     Num2D<double> InitCentroids;
     Num2D<double> Centroids;
+    // squared norm of every centroid, kept in step with Centroids by Training and Load
+    Num1D<double> CentroidNorms;
+    KMeansSummary Summary;
+    // Built by BuildIndex, then Predict searches it instead of scanning every centroid. Training drops it.
+    KDTree<double> CentroidIndex;
+    // E step of Training through a k-d tree rebuilt over the means every iteration. The build is O(K log K) per
+    // iteration, small next to the N K distances of the scan, but the search only prunes in low dimensions: on
+    // gaussian data it breaks even around K = IndexClustersPerDim * 2^D (128 centroids at 2 features, 512 at 4)
+    // and loses above, so Training scans anyway when IndexPaysOff is false.
+    bool IndexedTraining;
+    static const int IndexClustersPerDim = 32;
+    static const int IndexMaxCol = 16;
+    // Called after every Training iteration; returning false stops the training early.
+    std::function<bool(const KMeansIteration&)> Observer;
+    // Kept by Refresh, dropped by Training and Load.
+    KMeansWarmState WarmState;
     
     KMeans(const int clusters):
         Clusters(clusters),
         InitCentroids(mm),
-        Centroids(mm)
+        Centroids(mm),
+        CentroidNorms(mm),
+        IndexedTraining(false)
     {
         Num2D<double> n2d(this->mm);
+        Num1D<double> n1d(this->mm);
         this->InitCentroids = n2d.Create(1, 1);
         this->Centroids = n2d.Create(1, 1);
+        this->CentroidNorms = n1d.Create(1);
     }
     
     void InitializeRandom(Num2D<double> x) {
-        SpotNum1D<int> n1d;
+        SpotNum1D<long int> n1d;
         SpotNum2D<double> n2d;
         auto indexes = n1d.Arange(0, x.Row);
         auto shuffled = n1d.Shuffle(indexes);
@@ -33,41 +214,245 @@ class KMeans {
         this->InitCentroids.Release();
         this->InitCentroids = n2d.Clone(this->mm, initCentroids);
     }
-    void Initialize(Num2D<double> x, const int init) {
+    void InitializeRandom(SparseCSR<double> x) {
+        SpotNum1D<long int> n1d;
+        auto indexes = n1d.Arange(0, x.Row);
+        auto shuffled = n1d.Shuffle(indexes);
+        auto selected = n1d.Slice(shuffled, 0, this->Clusters);
+        auto initCentroids = x.Indexing(this->mm, selected);
+        this->InitCentroids.Release();
+        this->InitCentroids.Row = initCentroids.Row;
+        this->InitCentroids.Col = initCentroids.Col;
+        this->InitCentroids.Value = initCentroids.Value;
+    }
+    void InitializeRandom(Quantized2D x) {
+        SpotNum1D<long int> n1d;
+        auto indexes = n1d.Arange(0, x.Row);
+        auto shuffled = n1d.Shuffle(indexes);
+        Num2D<double> n2d(this->mm);
+        auto initCentroids = n2d.Create(this->Clusters, x.Col);
+        this->InitCentroids.Release();
+        this->InitCentroids.Row = initCentroids.Row;
+        this->InitCentroids.Col = initCentroids.Col;
+        this->InitCentroids.Value = initCentroids.Value;
+        for(int cluster = 0; cluster < this->Clusters; cluster += 1) {
+            x.DecodeRow(shuffled[cluster], this->InitCentroids[cluster]);
+        }
+    }
+    // X is Num2D<double>, SparseCSR<double> or Quantized2D.
+    template <typename X>
+    void Initialize(X x, const int init) {
         if(init == this->enumInitializeRandom) {
             this->InitializeRandom(x);
         } else {
             throw Format("error in %s: %d, unknown initialize parameter", __FUNCTION__, __LINE__);
         }
     }
-    Num1D<int> EStep(Num2D<double> means, Num2D<double> x) {
-        SpotNum1D<double> n1d;
-        SpotNum2D<double> n2d;
-        auto distances = n2d.Create(x.Row, this->Clusters);
-        for(int i = 0; i < x.Row; i += 1) {
-            for(int cluster = 0; cluster < this->Clusters; cluster += 1) {
-                distances[i][cluster] = n1d.CalcDistance(x.Ref(i), means.Ref(cluster));
+    // Rows per parallel chunk of an assignment: Parallel::MinWork distance terms, so the seeds data stays on one thread.
+    long int RowGrain(int col) const {
+        return std::max(64L, Parallel::MinWork / std::max(1L, (long int)this->Clusters * col));
+    }
+    
+    bool IndexPaysOff(long int col) const {
+        return col <= IndexMaxCol && this->Clusters >= ((long int)IndexClustersPerDim << col);
+    }
+    
+    // The rows are split over the thread pool; the inertia is summed per chunk, in chunk order.
+    Num1D<Label> EStep(Num2D<double> means, Num2D<double> x, double* inertia = NULL) {
+        MemoryTag tag(this->mm, "KMeans::EStep");
+        Num1D<Label> myN1d(this->mm);
+        auto predict = myN1d.Create(x.Row);
+        double total = 0;
+        if(this->IndexedTraining && this->IndexPaysOff(x.Col)) {
+            KDTree<double> tree;
+            tree.Build(means.Value, means.Row, means.Col);
+            DispatchDim(x.Col, [&](auto dim) {
+                total = Parallel::ParallelReduce(0, x.Row, this->RowGrain(x.Col), 0.0, [&](long int begin, long int end) {
+                    double partial = 0;
+                    for(long int i = begin; i < end; i += 1) {
+                        double distance;
+                        predict[i] = tree.Nearest<decltype(dim)::value>(x[i], &distance);
+                        partial += distance;
+                    }
+                    return partial;
+                }, std::plus<double>());
+            });
+        } else {
+            DispatchDim(x.Col, [&](auto dim) {
+                total = Parallel::ParallelReduce(0, x.Row, this->RowGrain(x.Col), 0.0, [&](long int begin, long int end) {
+                    return KMeansKernel<double, decltype(dim)::value>::EStep(means.Value, this->Clusters, x.Value + begin * x.Col, end - begin, x.Col, predict.Value + begin, (double*)NULL);
+                }, std::plus<double>());
+            });
+        }
+        if(inertia != NULL) {
+            *inertia = total;
+        }
+        return predict;
+    }
+    
+    Num2D<double> MStep(Num1D<Label> predict, Num2D<double> x, std::vector<long int>* clusterSizes = NULL) {
+        MemoryTag tag(this->mm, "KMeans::MStep");
+        Num2D<double> myN2d(this->mm);
+        auto means = myN2d.Create(this->Clusters, x.Col);
+        std::vector<long int> counts(this->Clusters);
+        DispatchDim(x.Col, [&](auto dim) {
+            KMeansKernel<double, decltype(dim)::value>::MStep(predict.Value, x.Value, x.Row, x.Col, this->Clusters, means.Value, counts.data());
+        });
+        if(clusterSizes != NULL) {
+            clusterSizes->swap(counts);
+        }
+        return means;
+    }
+    
+    ////////////////////////////////////////
+    // sparse input
+    ////////////////////////////////////////
+    // |x - c|^2 = |x|^2 - 2 x.c + |c|^2, so a row costs its non-zeros times Clusters instead of Col times Clusters.
+    // norms are the squared norms of the means. Returns the inertia.
+    double SparseAssign(const double* means, const double* norms, SparseCSR<double> x, Label* predict) const {
+        // the work of a row is its non-zeros, so the grain assumes the average density
+        const int width = std::max(1L, x.Nnz / std::max(1L, x.Row));
+        return Parallel::ParallelReduce(0, x.Row, this->RowGrain(width), 0.0, [&](long int begin, long int end) {
+            double inertia = 0;
+            for(long int i = begin; i < end; i += 1) {
+                auto row = x[i];
+                const double rowNorm = row.SquaredNorm();
+                double best = 0;
+                Label bestIndex = -1;
+                for(int cluster = 0; cluster < this->Clusters; cluster += 1) {
+                    double distance = norms[cluster] - 2 * row.Dot(means + (long int)cluster * x.Col);
+                    if(bestIndex < 0 || distance < best) {
+                        best = distance;
+                        bestIndex = cluster;
+                    }
+                }
+                predict[i] = bestIndex;
+                inertia += std::max(0.0, rowNorm + best);
+            }
+            return inertia;
+        }, std::plus<double>());
+    }
+    
+    Num1D<Label> EStep(Num2D<double> means, SparseCSR<double> x, double* inertia = NULL) {
+        MemoryTag tag(this->mm, "KMeans::EStep");
+        Num1D<Label> myN1d(this->mm);
+        auto predict = myN1d.Create(x.Row);
+        std::vector<double> norms(means.Row);
+        for(int cluster = 0; cluster < means.Row; cluster += 1) {
+            norms[cluster] = 0;
+            for(int n = 0; n < means.Col; n += 1) {
+                norms[cluster] += means[cluster][n] * means[cluster][n];
             }
         }
-        
-        Num1D<int> myN1d(this->mm);
+        double total = this->SparseAssign(means.Value, norms.data(), x, predict.Value);
+        if(inertia != NULL) {
+            *inertia = total;
+        }
+        return predict;
+    }
+    
+    Num2D<double> MStep(Num1D<Label> predict, SparseCSR<double> x, std::vector<long int>* clusterSizes = NULL) {
+        MemoryTag tag(this->mm, "KMeans::MStep");
+        Num2D<double> myN2d(this->mm);
+        auto means = myN2d.Create(this->Clusters, x.Col);
+        memset(means.Value, 0, sizeof(double) * means.Row * means.Col);
+        std::vector<long int> counts(this->Clusters);
+        for(long int i = 0; i < x.Row; i += 1) {
+            x[i].AddTo(means[predict[i]]);
+            counts[predict[i]] += 1;
+        }
+        for(int cluster = 0; cluster < this->Clusters; cluster += 1) {
+            for(int n = 0; n < x.Col; n += 1) {
+                means[cluster][n] /= counts[cluster];
+            }
+        }
+        if(clusterSizes != NULL) {
+            clusterSizes->swap(counts);
+        }
+        return means;
+    }
+    
+    ////////////////////////////////////////
+    // quantized input
+    ////////////////////////////////////////
+    // Distances from the decoded row. The exact distance is within x.Error[i] of the decoded one, so when another
+    // mean is within 2 x.Error[i] of the nearest, the near ties are rescored against x.Source (when kept) and the
+    // assignment is the one of the exact data. rescored (unless NULL) gets the number of rows that needed it.
+    // Returns the inertia, exact for the rescored rows and from the decoded rows for the others.
+    double QuantizedAssign(const double* means, Quantized2D x, Label* predict, long int* rescored = NULL) const {
+        std::pair<double, long int> total = Quantize::DispatchFormat(x.Format, [&](auto format) {
+            return DispatchDim(x.Col, [&](auto dim) {
+                const int D = decltype(dim)::value;
+                const int col = x.Col;
+                return Parallel::ParallelReduce(0, x.Row, this->RowGrain(col), std::make_pair(0.0, 0L), [&](long int begin, long int end) {
+                    std::pair<double, long int> partial(0.0, 0L);
+                    // a fixed D row stays in registers, as in KMeansKernel::EStep
+                    double local[D == Dynamic ? 1 : D];
+                    std::vector<double> buffer((D == Dynamic) ? col : 0);
+                    double* decoded = (D == Dynamic) ? buffer.data() : local;
+                    for(long int i = begin; i < end; i += 1) {
+                        x.template DecodeRow<decltype(format)::value, D>(i, decoded);
+                        double best, second;
+                        Label bestIndex = KMeansKernel<double, D>::Nearest2(means, this->Clusters, decoded, col, &best, &second);
+                        if(x.Source.Value != NULL && second < std::numeric_limits<double>::max()) {
+                            const double limit = sqrt(best) + 2 * x.Error[i];
+                            if(second <= limit * limit) {
+                                partial.second += 1;
+                                double exact;
+                                bestIndex = KMeansKernel<double, D>::Nearest2(means, this->Clusters, x.Source[i], col, &exact, &second);
+                                best = exact;
+                            }
+                        }
+                        predict[i] = bestIndex;
+                        partial.first += best;
+                    }
+                    return partial;
+                }, [](std::pair<double, long int> a, const std::pair<double, long int>& b) {
+                    return std::make_pair(a.first + b.first, a.second + b.second);
+                });
+            });
+        });
+        if(rescored != NULL) {
+            *rescored = total.second;
+        }
+        return total.first;
+    }
+    
+    Num1D<Label> EStep(Num2D<double> means, Quantized2D x, double* inertia = NULL) {
+        MemoryTag tag(this->mm, "KMeans::EStep");
+        Num1D<Label> myN1d(this->mm);
         auto predict = myN1d.Create(x.Row);
-        for(int i = 0; i < x.Row; i += 1) {
-            predict[i] = n1d.ArgMin(distances.Ref(i));
+        double total = this->QuantizedAssign(means.Value, x, predict.Value);
+        if(inertia != NULL) {
+            *inertia = total;
         }
         return predict;
     }
     
-    Num2D<double> MStep(Num1D<int> predict, Num2D<double> x) {
+    // Means of the decoded rows.
+    Num2D<double> MStep(Num1D<Label> predict, Quantized2D x, std::vector<long int>* clusterSizes = NULL) {
+        MemoryTag tag(this->mm, "KMeans::MStep");
         Num2D<double> myN2d(this->mm);
         auto means = myN2d.Create(this->Clusters, x.Col);
+        memset(means.Value, 0, sizeof(double) * means.Row * means.Col);
+        std::vector<long int> counts(this->Clusters);
+        std::vector<double> decoded(x.Col);
+        Quantize::DispatchFormat(x.Format, [&](auto format) {
+            DispatchDim(x.Col, [&](auto dim) {
+                for(long int i = 0; i < x.Row; i += 1) {
+                    x.template DecodeRow<decltype(format)::value, decltype(dim)::value>(i, decoded.data());
+                    FixedDim<double, decltype(dim)::value>::Add(means[predict[i]], decoded.data(), x.Col);
+                    counts[predict[i]] += 1;
+                }
+            });
+        });
         for(int cluster = 0; cluster < this->Clusters; cluster += 1) {
-            SpotNum1D<int> n1d;
-            SpotNum2D<double> n2d;
-            auto idxs = n1d.WhereEq(predict, cluster);
-            auto ix = n2d.Indexing(x, idxs);
-            auto mean = ix.Mean();
-            means.Ref(cluster).Copy(mean);
+            for(int n = 0; n < x.Col; n += 1) {
+                means[cluster][n] /= counts[cluster];
+            }
+        }
+        if(clusterSizes != NULL) {
+            clusterSizes->swap(counts);
         }
         return means;
     }
@@ -82,26 +467,330 @@ class KMeans {
         return sqrt(total / (double)a.Row);
     }
     
-    void Training(Num2D<double> x, int maxIter=100, double threshold=1e-5) {
+    // Summary tells how it ended: Converged when the shift fell below threshold,
+    // Stopped when the Observer asked to stop, neither when maxIter ran out.
+    template <typename X>
+    void Training(X x, int maxIter=100, double threshold=1e-5) {
+        typedef std::chrono::steady_clock Clock;
+        auto start = Clock::now();
+        this->Summary = KMeansSummary();
+        this->CentroidIndex.Clear();
+        this->WarmState.Clear();
         Num2D<double> myN2d(this->mm);
         this->Centroids.Release();
         this->Centroids = myN2d.Create(this->Clusters, x.Col);
         SpotNum2D<double> n2d;
         auto means = n2d.Clone(this->InitCentroids);
+        KMeansIteration iteration;
         for(int i = 0; i < maxIter; i += 1) {
-            auto predict = this->EStep(means, x);
-            auto newMeans = this->MStep(predict, x);
+            iteration.Iteration = i;
+            iteration.Scanned = x.Row;
+            auto t0 = Clock::now();
+            auto predict = this->EStep(means, x, &iteration.Inertia);
+            auto t1 = Clock::now();
+            auto newMeans = this->MStep(predict, x, &iteration.ClusterSizes);
+            auto t2 = Clock::now();
+            iteration.EStepSeconds = std::chrono::duration<double>(t1 - t0).count();
+            iteration.MStepSeconds = std::chrono::duration<double>(t2 - t1).count();
             
             predict.Release();
             
-            double distance = this->CalcMeansDistance(means, newMeans);
+            iteration.Shift = this->CalcMeansDistance(means, newMeans);
+            means.Copy(newMeans);
+            newMeans.Release();
+            
+            if(this->EndIteration(iteration, threshold)) {
+                break;
+            }
+        }
+        this->Centroids.Copy(means);
+        this->UpdateCentroidNorms();
+        this->Summary.TotalSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    
+    // Adds iteration to Summary and tells whether the training ends here.
+    bool EndIteration(const KMeansIteration& iteration, double threshold) {
+        this->Summary.Iterations = iteration.Iteration + 1;
+        this->Summary.Shift = iteration.Shift;
+        this->Summary.Inertia = iteration.Inertia;
+        this->Summary.EmptyClusters = std::count(iteration.ClusterSizes.begin(), iteration.ClusterSizes.end(), 0);
+        this->Summary.EStepSeconds += iteration.EStepSeconds;
+        this->Summary.MStepSeconds += iteration.MStepSeconds;
+        if(this->Observer && !this->Observer(iteration)) {
+            this->Summary.Stopped = true;
+            return true;
+        }
+        if(iteration.Shift < threshold) {
+            this->Summary.Converged = true;
+            return true;
+        }
+        return false;
+    }
+    
+    void UpdateCentroidNorms() {
+        if(this->CentroidNorms.Count != this->Centroids.Row) {
+            Num1D<double> n1d(this->mm);
+            auto norms = n1d.Create(this->Centroids.Row);
+            this->CentroidNorms.Release();
+            this->CentroidNorms.Count = norms.Count;
+            this->CentroidNorms.Value = norms.Value;
+        }
+        for(int cluster = 0; cluster < this->Centroids.Row; cluster += 1) {
+            double norm = 0;
+            for(int n = 0; n < this->Centroids.Col; n += 1) {
+                norm += this->Centroids[cluster][n] * this->Centroids[cluster][n];
+            }
+            this->CentroidNorms[cluster] = norm;
+        }
+    }
+    
+    ////////////////////////////////////////
+    // warm start
+    ////////////////////////////////////////
+    // Trains again after a small change of the data, from Centroids and the WarmState of the previous Refresh.
+    // x is the previous data without the rows at removed (ascending indices into the previous data), in the same
+    // order, followed by the appended rows; removedRows holds the values of the removed rows, which leave the
+    // cluster sums. The sums are only updated by the rows that come, go or move, so the rounding of the updates
+    // adds up; every KMeansWarmState::RebuildEvery calls they are recomputed from x, at the cost of one pass over
+    // it. Every iteration is a Lloyd iteration, so the means are the ones Training from Centroids would
+    // reach, but a row only gets distances computed when it is new or the centroid shifts broke its bounds; the
+    // others cost a bound update. The first Refresh after Training or Load assigns every row once.
+    // An empty cluster keeps its centroid.
+    void Refresh(Num2D<double> x, Num1D<long int> removed, Num2D<double> removedRows, int maxIter=100, double threshold=1e-5) {
+        typedef std::chrono::steady_clock Clock;
+        auto start = Clock::now();
+        KMeansWarmState& state = this->WarmState;
+        const long int kept = state.Rows() - removed.Count;
+        if(CheckLevel >= 1 && state.Rows() > 0 && state.Col != x.Col) {
+            throw Format("error in %s: %d, model has %d features, got %ld", __FUNCTION__, __LINE__, state.Col, x.Col);
+        }
+        if(CheckLevel >= 1 && (removedRows.Row != removed.Count || (removed.Count > 0 && removedRows.Col != x.Col))) {
+            throw Format("error in %s: %d, %ld removed indexes, removedRows is (%ld, %ld)", __FUNCTION__, __LINE__, removed.Count, removedRows.Row, removedRows.Col);
+        }
+        if(kept < 0 || kept > x.Row) {
+            throw Format("error in %s: %d, %ld of %ld rows removed, x has %ld", __FUNCTION__, __LINE__, removed.Count, state.Rows(), x.Row);
+        }
+        for(long int r = 0; r < removed.Count; r += 1) {
+            if(removed[r] < 0 || removed[r] >= state.Rows() || (r > 0 && removed[r] <= removed[r - 1])) {
+                throw Format("error in %s: %d, removed[%ld] = %ld is out of order or range", __FUNCTION__, __LINE__, r, removed[r]);
+            }
+        }
+        this->Summary = KMeansSummary();
+        this->CentroidIndex.Clear();
+        SpotNum2D<double> n2d;
+        const bool trained = (this->Centroids.Row == this->Clusters && this->Centroids.Col == x.Col);
+        auto means = n2d.Clone(trained ? this->Centroids : this->InitCentroids);
+        const bool rebuild = (state.Rows() == 0 || state.Updates >= KMeansWarmState::RebuildEvery);
+        state.Col = x.Col;
+        
+        // removed rows leave the sums, then the state of the kept ones moves up
+        if(!rebuild) {
+            for(long int r = 0; r < removed.Count; r += 1) {
+                this->WarmAccumulate(removedRows[r], state.Assign[removed[r]], -1);
+            }
+        }
+        long int next = 0;
+        for(long int i = 0, r = 0; i < state.Rows(); i += 1) {
+            if(r < removed.Count && removed[r] == i) {
+                r += 1;
+                continue;
+            }
+            state.Assign[next] = state.Assign[i];
+            state.Upper[next] = state.Upper[i];
+            state.Lower[next] = state.Lower[i];
+            next += 1;
+        }
+        
+        // appended rows are assigned against the starting means, with exact bounds
+        state.Assign.resize(x.Row);
+        state.Upper.resize(x.Row);
+        state.Lower.resize(x.Row);
+        DispatchDim(x.Col, [&](auto dim) {
+            Parallel::ParallelFor(kept, x.Row, this->RowGrain(x.Col), [&](long int begin, long int end) {
+                for(long int i = begin; i < end; i += 1) {
+                    double best, second;
+                    state.Assign[i] = KMeansKernel<double, decltype(dim)::value>::Nearest2(means.Value, this->Clusters, x[i], x.Col, &best, &second);
+                    state.Upper[i] = sqrt(best);
+                    state.Lower[i] = sqrt(second);
+                }
+            });
+        });
+        if(rebuild) {
+            // around the starting means, from every row
+            state.References.assign(means.Value, means.Value + (long int)this->Clusters * x.Col);
+            state.Sums.assign((size_t)this->Clusters * x.Col, 0);
+            state.SquaredDistances.assign(this->Clusters, 0);
+            state.Counts.assign(this->Clusters, 0);
+            for(long int i = 0; i < x.Row; i += 1) {
+                this->WarmAccumulate(x[i], state.Assign[i], 1);
+            }
+            state.Updates = 0;
+        } else {
+            for(long int i = kept; i < x.Row; i += 1) {
+                this->WarmAccumulate(x[i], state.Assign[i], 1);
+            }
+            state.Updates += 1;
+        }
+        
+        KMeansIteration iteration;
+        for(int i = 0; i < maxIter; i += 1) {
+            iteration.Iteration = i;
+            auto t0 = Clock::now();
+            iteration.Scanned = this->WarmEStep(means, x) + ((i == 0) ? x.Row - kept : 0);
+            iteration.Inertia = this->WarmInertia(means);
+            iteration.ClusterSizes = state.Counts;
+            auto t1 = Clock::now();
+            auto newMeans = n2d.Clone(means);
+            std::vector<double> shifts(this->Clusters);
+            for(int cluster = 0; cluster < this->Clusters; cluster += 1) {
+                if(state.Counts[cluster] > 0) {
+                    for(int n = 0; n < x.Col; n += 1) {
+                        const long int at = (long int)cluster * x.Col + n;
+                        newMeans[cluster][n] = state.References[at] + state.Sums[at] / state.Counts[cluster];
+                    }
+                }
+                shifts[cluster] = sqrt(FixedDim<double, Dynamic>::SquaredDistance(means[cluster], newMeans[cluster], x.Col));
+            }
+            this->WarmShiftBounds(shifts);
+            auto t2 = Clock::now();
+            iteration.EStepSeconds = std::chrono::duration<double>(t1 - t0).count();
+            iteration.MStepSeconds = std::chrono::duration<double>(t2 - t1).count();
+            
+            iteration.Shift = this->CalcMeansDistance(means, newMeans);
             means.Copy(newMeans);
             newMeans.Release();
-            if(distance < threshold) {
+            
+            if(this->EndIteration(iteration, threshold)) {
                 break;
             }
         }
+        if(!trained) {
+            Num2D<double> myN2d(this->mm);
+            this->Centroids.Release();
+            this->Centroids = myN2d.Create(this->Clusters, x.Col);
+        }
         this->Centroids.Copy(means);
+        this->UpdateCentroidNorms();
+        this->Summary.TotalSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    
+    // Appended rows only.
+    void Refresh(Num2D<double> x, int maxIter=100, double threshold=1e-5) {
+        SpotNum1D<long int> removed;
+        SpotNum2D<double> removedRows;
+        this->Refresh(x, removed, removedRows, maxIter, threshold);
+    }
+    
+    // Adds row to (sign 1) or takes it out of (sign -1) the running sums of cluster.
+    void WarmAccumulate(const double* row, Label cluster, int sign) {
+        KMeansWarmState& state = this->WarmState;
+        const double* reference = state.References.data() + (long int)cluster * state.Col;
+        double* sum = state.Sums.data() + (long int)cluster * state.Col;
+        double distance = 0;
+        for(int n = 0; n < state.Col; n += 1) {
+            const double d = row[n] - reference[n];
+            sum[n] += sign * d;
+            distance += d * d;
+        }
+        state.SquaredDistances[cluster] += sign * distance;
+        state.Counts[cluster] += sign;
+    }
+    
+    // Hamerly's test: a row stays where it is while Upper <= max(Lower, half the distance from its centroid to the
+    // nearest other one). The others are tightened and, if that is not enough, scanned against every mean.
+    // Moves are applied to the sums in row order, so the result does not depend on the thread count.
+    // Returns the number of rows that needed distances.
+    long int WarmEStep(Num2D<double> means, Num2D<double> x) {
+        KMeansWarmState& state = this->WarmState;
+        std::vector<double> halfGaps(this->Clusters, std::numeric_limits<double>::max());
+        for(int a = 0; a < this->Clusters; a += 1) {
+            for(int b = a + 1; b < this->Clusters; b += 1) {
+                double gap = 0.5 * sqrt(FixedDim<double, Dynamic>::SquaredDistance(means[a], means[b], x.Col));
+                halfGaps[a] = std::min(halfGaps[a], gap);
+                halfGaps[b] = std::min(halfGaps[b], gap);
+            }
+        }
+        KMeansWarmState::Moves moves;
+        DispatchDim(x.Col, [&](auto dim) {
+            typedef KMeansKernel<double, decltype(dim)::value> Kernel;
+            moves = Parallel::ParallelReduce(0, x.Row, Parallel::MinWork, KMeansWarmState::Moves(), [&](long int begin, long int end) {
+                KMeansWarmState::Moves partial;
+                for(long int i = begin; i < end; i += 1) {
+                    const Label current = state.Assign[i];
+                    const double bound = std::max(halfGaps[current], state.Lower[i]);
+                    if(state.Upper[i] <= bound) {
+                        continue;
+                    }
+                    partial.Scanned += 1;
+                    state.Upper[i] = sqrt(FixedDim<double, decltype(dim)::value>::SquaredDistance(x[i], means[current], x.Col));
+                    if(state.Upper[i] <= bound) {
+                        continue;
+                    }
+                    double best, second;
+                    state.Assign[i] = Kernel::Nearest2(means.Value, this->Clusters, x[i], x.Col, &best, &second);
+                    state.Upper[i] = sqrt(best);
+                    state.Lower[i] = sqrt(second);
+                    if(state.Assign[i] != current) {
+                        partial.Rows.push_back(std::make_pair(i, current));
+                    }
+                }
+                return partial;
+            }, [](KMeansWarmState::Moves total, const KMeansWarmState::Moves& partial) {
+                total.Scanned += partial.Scanned;
+                total.Rows.insert(total.Rows.end(), partial.Rows.begin(), partial.Rows.end());
+                return total;
+            });
+        });
+        for(auto move = moves.Rows.begin(); move != moves.Rows.end(); move++) {
+            this->WarmAccumulate(x[move->first], move->second, -1);
+            this->WarmAccumulate(x[move->first], state.Assign[move->first], 1);
+        }
+        return moves.Scanned;
+    }
+    
+    // Sum over the clusters of |x - m|^2 = |x - r|^2 - 2 (x - r).(m - r) + |m - r|^2 from the running sums around
+    // the reference r, without reading x. m stays close to r, so the last two terms are small corrections.
+    double WarmInertia(Num2D<double> means) {
+        const KMeansWarmState& state = this->WarmState;
+        double inertia = 0;
+        for(int cluster = 0; cluster < this->Clusters; cluster += 1) {
+            const double* reference = state.References.data() + (long int)cluster * state.Col;
+            const double* sum = state.Sums.data() + (long int)cluster * state.Col;
+            double dot = 0;
+            double norm = 0;
+            for(int n = 0; n < state.Col; n += 1) {
+                const double shift = means[cluster][n] - reference[n];
+                dot += sum[n] * shift;
+                norm += shift * shift;
+            }
+            inertia += state.SquaredDistances[cluster] - 2 * dot + state.Counts[cluster] * norm;
+        }
+        return inertia;
+    }
+    
+    // After the means moved by shifts: Upper grows by the shift of the own centroid, Lower shrinks by the largest
+    // shift of any other one.
+    void WarmShiftBounds(const std::vector<double>& shifts) {
+        KMeansWarmState& state = this->WarmState;
+        int largest = 0;
+        for(int cluster = 1; cluster < this->Clusters; cluster += 1) {
+            if(shifts[cluster] > shifts[largest]) {
+                largest = cluster;
+            }
+        }
+        double secondLargest = 0;
+        for(int cluster = 0; cluster < this->Clusters; cluster += 1) {
+            if(cluster != largest) {
+                secondLargest = std::max(secondLargest, shifts[cluster]);
+            }
+        }
+        Parallel::ParallelFor(0, state.Rows(), Parallel::MinWork, [&](long int begin, long int end) {
+            for(long int i = begin; i < end; i += 1) {
+                const Label current = state.Assign[i];
+                state.Upper[i] += shifts[current];
+                state.Lower[i] -= (current == largest) ? secondLargest : shifts[largest];
+            }
+        });
     }
     
     Num2D<double> GetInitCentroids(MemoryManager& mm) {
@@ -114,9 +803,138 @@ class KMeans {
         return n2d.Clone(this->Centroids);
     }
     
-    Num1D<int> GetPredict(MemoryManager& mm, Num2D<double> x) {
-        auto predict = this->EStep(this->Centroids, x);
-        Num1D<int> n1d(mm);
-        return n1d.Clone(predict);
+    Num1D<Label> GetPredict(MemoryManager& mm, Num2D<double> x) {
+        Num1D<Label> n1d(mm);
+        auto predict = n1d.Create(x.Row);
+        this->Predict(x.Value, x.Row, x.Col, predict.Value, (double*)NULL);
+        return predict;
+    }
+    
+    Num1D<Label> GetPredict(MemoryManager& mm, SparseCSR<double> x) {
+        if(CheckLevel >= 1 && x.Col != this->Centroids.Col) {
+            throw Format("error in %s: %d, model has %ld features, got %ld", __FUNCTION__, __LINE__, this->Centroids.Col, x.Col);
+        }
+        Num1D<Label> n1d(mm);
+        auto predict = n1d.Create(x.Row);
+        this->SparseAssign(this->Centroids.Value, this->CentroidNorms.Value, x, predict.Value);
+        return predict;
+    }
+    
+    Num1D<Label> GetPredict(MemoryManager& mm, Quantized2D x) {
+        if(CheckLevel >= 1 && x.Col != this->Centroids.Col) {
+            throw Format("error in %s: %d, model has %ld features, got %ld", __FUNCTION__, __LINE__, this->Centroids.Col, x.Col);
+        }
+        Num1D<Label> n1d(mm);
+        auto predict = n1d.Create(x.Row);
+        this->QuantizedAssign(this->Centroids.Value, x, predict.Value);
+        return predict;
+    }
+    
+    ////////////////////////////////////////
+    // snapshot
+    ////////////////////////////////////////
+    int Save(const char* fileName) {
+        Snapshot::Writer writer(Snapshot::KindKMeans);
+        writer.Add("init_centroids", this->InitCentroids);
+        writer.Add("centroids", this->Centroids);
+        writer.Add("centroid_norms", this->CentroidNorms);
+        return writer.Save(fileName);
+    }
+    
+    // Copies a snapshot into this model, which must have the same number of clusters.
+    void Load(const char* fileName) {
+        Snapshot::File file(fileName, Snapshot::KindKMeans);
+        MemoryManager tmp;
+        auto centroids = file.Num2DView<double>(tmp, "centroids", this->Clusters);
+        auto initCentroids = file.Num2DView<double>(tmp, "init_centroids", -1, centroids.Col);
+        auto norms = file.Num1DView<double>(tmp, "centroid_norms", this->Clusters);
+        // operator= clones into this->mm
+        this->InitCentroids.Release();
+        this->Centroids.Release();
+        this->CentroidNorms.Release();
+        this->InitCentroids = initCentroids;
+        this->Centroids = centroids;
+        this->CentroidNorms = norms;
+        this->CentroidIndex.Clear();
+        this->WarmState.Clear();
+    }
+    
+    static int SnapshotClusters(const Snapshot::File& file) {
+        for(auto section = file.Sections.begin(); section != file.Sections.end(); section++) {
+            if(section->Name == "centroids") {
+                return section->Row;
+            }
+        }
+        throw Format("error in %s: %d, snapshot has no centroids", __FUNCTION__, __LINE__);
+    }
+    
+    ////////////////////////////////////////
+    // serving
+    ////////////////////////////////////////
+    // epsilon 0 keeps Predict exact, epsilon > 0 trades accuracy (within a factor 1 + epsilon of the nearest distance) for speed.
+    void BuildIndex(double epsilon = 0, int leafSize = 8) {
+        this->CentroidIndex.Build(this->Centroids.Value, this->Centroids.Row, this->Centroids.Col, epsilon, leafSize);
+    }
+    
+    // Nearest centroid of rows samples of col features each, written to predict[rows] and,
+    // unless NULL, the squared distance to it to squaredDistance[rows].
+    // The model is only read, so a trained model can be queried from many threads at once. Batches below
+    // RowGrain run inline and allocate nothing; larger ones are split over the thread pool.
+    void Predict(const double* x, long int rows, int col, Label* predict, double* squaredDistance) const {
+        if(CheckLevel >= 1 && col != this->Centroids.Col) {
+            throw Format("error in %s: %d, model has %ld features, got %d", __FUNCTION__, __LINE__, this->Centroids.Col, col);
+        }
+        DispatchDim(col, [&](auto dim) {
+            Parallel::ParallelFor(0, rows, this->RowGrain(col), [&](long int begin, long int end) {
+                if(this->CentroidIndex.Built()) {
+                    for(long int i = begin; i < end; i += 1) {
+                        double distance;
+                        predict[i] = this->CentroidIndex.template Nearest<decltype(dim)::value>(x + i * col, &distance);
+                        if(squaredDistance != NULL) {
+                            squaredDistance[i] = distance;
+                        }
+                    }
+                } else {
+                    KMeansKernel<double, decltype(dim)::value>::EStep(this->Centroids.Value, this->Clusters, x + begin * col, end - begin, col,
+                        predict + begin, (squaredDistance == NULL) ? NULL : squaredDistance + begin);
+                }
+            });
+        });
+    }
+    
+    // Single sample, returns the cluster.
+    Label Predict(const double* sample, int col, double* squaredDistance = NULL) const {
+        Label cluster;
+        this->Predict(sample, 1, col, &cluster, squaredDistance);
+        return cluster;
+    }
+};
+
+// A trained model used in place from a read-only mapping of its snapshot: nothing is parsed or copied, and worker
+// processes mapping the same file share one copy through the page cache. For Predict/GetPredict only, not Training.
+class MappedKMeans: public KMeans {
+    public:
+    std::unique_ptr<Snapshot::File> File;
+    MappedKMeans(const char* fileName, bool verify = true):
+        MappedKMeans(std::unique_ptr<Snapshot::File>(new Snapshot::File(fileName, Snapshot::KindKMeans, verify))) {}
+    MappedKMeans(const MappedKMeans&) = delete;
+    MappedKMeans& operator=(const MappedKMeans&) = delete;
+    
+    private:
+    MappedKMeans(std::unique_ptr<Snapshot::File> file): KMeans(SnapshotClusters(*file)), File(std::move(file)) {
+        this->InitCentroids.Release();
+        this->Centroids.Release();
+        this->CentroidNorms.Release();
+        auto centroids = this->File->Num2DView<double>(this->mm, "centroids", this->Clusters);
+        auto initCentroids = this->File->Num2DView<double>(this->mm, "init_centroids", -1, centroids.Col);
+        auto norms = this->File->Num1DView<double>(this->mm, "centroid_norms", this->Clusters);
+        this->Centroids.Row = centroids.Row;
+        this->Centroids.Col = centroids.Col;
+        this->Centroids.Value = centroids.Value;
+        this->InitCentroids.Row = initCentroids.Row;
+        this->InitCentroids.Col = initCentroids.Col;
+        this->InitCentroids.Value = initCentroids.Value;
+        this->CentroidNorms.Count = norms.Count;
+        this->CentroidNorms.Value = norms.Value;
     }
 };
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <math.h>
+
+#include <limits>
+#include <random>
+
+#include "distance.h"
+#include "numxd.h"
+
+// Quality of a clustering of x (Num2D) given the labels GetPredict returned, sklearn.metrics style.
+// The inertia of the training data is a by-product of KMeans::Training (Summary.Inertia, against the means of the
+// last E step); Inertia here measures it against any centroids. Silhouette is exact and streams the N x N distances
+// through Distance::CDistTiles, so it needs N x clusters memory, not N x N; SampledSilhouette scores only a random
+// sample of the rows against all of them and gives a confidence interval.
+namespace Metrics {
+    // Clusters are 0 .. the largest label.
+    int Clusters(Num1D<Label> labels) {
+        Label largest = -1;
+        for(long int i = 0; i < labels.Count; i += 1) {
+            if(labels[i] < 0) {
+                throw Format("error in %s: %d, labels[%ld] = %d is negative", __FUNCTION__, __LINE__, i, labels[i]);
+            }
+            largest = std::max(largest, labels[i]);
+        }
+        return largest + 1;
+    }
+
+    void CheckLabels(Num2D<double> x, Num1D<Label> labels) {
+        if(CheckLevel >= 1 && labels.Count != x.Row) {
+            throw Format("error in %s: %d, %ld labels for %ld rows", __FUNCTION__, __LINE__, labels.Count, x.Row);
+        }
+    }
+
+    std::vector<long int> ClusterSizes(Num1D<Label> labels, int clusters) {
+        std::vector<long int> sizes(clusters, 0);
+        for(long int i = 0; i < labels.Count; i += 1) {
+            sizes[labels[i]] += 1;
+        }
+        return sizes;
+    }
+
+    // clusters x x.Col means of the rows of every cluster, zero for an empty one.
+    std::vector<double> ClusterMeans(Num2D<double> x, Num1D<Label> labels, const std::vector<long int>& sizes) {
+        std::vector<double> means(sizes.size() * x.Col, 0);
+        for(long int i = 0; i < x.Row; i += 1) {
+            FixedDim<double, Dynamic>::Add(means.data() + (long int)labels[i] * x.Col, x[i], x.Col);
+        }
+        for(size_t cluster = 0; cluster < sizes.size(); cluster += 1) {
+            for(long int n = 0; n < x.Col; n += 1) {
+                means[cluster * x.Col + n] /= std::max(1L, sizes[cluster]);
+            }
+        }
+        return means;
+    }
+
+    ////////////////////////////////////////
+    // inertia
+    ////////////////////////////////////////
+    // Total squared distance of every row to the centroid of its label.
+    double Inertia(Num2D<double> x, Num1D<Label> labels, Num2D<double> centroids, int threads = 0) {
+        CheckLabels(x, labels);
+        if(CheckLevel >= 1 && (centroids.Col != x.Col || Clusters(labels) > centroids.Row)) {
+            throw Format("error in %s: %d, centroids are (%ld, %ld) for %ld features", __FUNCTION__, __LINE__, centroids.Row, centroids.Col, x.Col);
+        }
+        return Parallel::ParallelReduce(0, x.Row, Parallel::MinWork / std::max(1L, x.Col), 0.0, [&](long int begin, long int end) {
+            double partial = 0;
+            for(long int i = begin; i < end; i += 1) {
+                partial += FixedDim<double, Dynamic>::SquaredDistance(x[i], centroids[labels[i]], x.Col);
+            }
+            return partial;
+        }, std::plus<double>(), threads);
+    }
+
+    ////////////////////////////////////////
+    // silhouette
+    ////////////////////////////////////////
+    // s of every row of queries (labelled queryLabels) within x: (b - a) / max(a, b), a the mean distance to the
+    // other rows of its cluster and b the smallest mean distance to another non-empty cluster; 0 in a cluster of one.
+    // The distance totals per cluster are filled tile by tile, a tile only touches rows its thread owns.
+    std::vector<double> SilhouetteRows(Num2D<double> queries, const Label* queryLabels, Num2D<double> x, Num1D<Label> labels, int clusters, int threads) {
+        const std::vector<long int> sizes = ClusterSizes(labels, clusters);
+        std::vector<double> totals((size_t)queries.Row * clusters, 0);
+        Distance::CDistTiles<double>(queries, x, MetricEuclidean, [&](const Distance::Tile<double>& tile) {
+            for(int i = 0; i < tile.Rows; i += 1) {
+                double* total = totals.data() + (tile.RowStart + i) * clusters;
+                const double* distance = tile.Value + i * tile.Stride;
+                for(int j = 0; j < tile.Cols; j += 1) {
+                    total[labels[tile.ColStart + j]] += distance[j];
+                }
+            }
+        }, threads);
+        std::vector<double> scores(queries.Row);
+        for(long int i = 0; i < queries.Row; i += 1) {
+            const Label own = queryLabels[i];
+            const double* total = totals.data() + i * clusters;
+            if(sizes[own] <= 1) {
+                scores[i] = 0;
+                continue;
+            }
+            double a = total[own] / (sizes[own] - 1);
+            double b = std::numeric_limits<double>::max();
+            for(int cluster = 0; cluster < clusters; cluster += 1) {
+                if(cluster != own && sizes[cluster] > 0) {
+                    b = std::min(b, total[cluster] / sizes[cluster]);
+                }
+            }
+            scores[i] = (b == std::numeric_limits<double>::max()) ? 0 : (b - a) / std::max(a, b);
+        }
+        return scores;
+    }
+
+    // Mean silhouette of all rows, O(N^2) distances computed once each in cache-sized tiles over the thread pool.
+    double Silhouette(Num2D<double> x, Num1D<Label> labels, int threads = 0) {
+        CheckLabels(x, labels);
+        auto scores = SilhouetteRows(x, labels.Value, x, labels, Clusters(labels), threads);
+        double total = 0;
+        for(auto score = scores.begin(); score != scores.end(); score++) {
+            total += *score;
+        }
+        return total / std::max(1L, x.Row);
+    }
+
+    // Score within [Lower, Upper] at the confidence of z (1.96: 95%), from Samples rows.
+    class Estimate {
+        public:
+        double Score;
+        double Lower;
+        double Upper;
+        long int Samples;
+        Estimate(): Score(0), Lower(0), Upper(0), Samples(0) {}
+    };
+
+    // Mean silhouette of samples rows drawn without replacement, each scored exactly against every row: O(samples N).
+    // The interval is the normal one with the finite population correction, so it closes when samples reaches x.Row.
+    Estimate SampledSilhouette(Num2D<double> x, Num1D<Label> labels, long int samples, unsigned int seed = 1, double z = 1.96, int threads = 0) {
+        CheckLabels(x, labels);
+        samples = std::min(samples, x.Row);
+        if(samples <= 0) {
+            throw Format("error in %s: %d, %ld samples", __FUNCTION__, __LINE__, samples);
+        }
+        // the first samples places of a partial Fisher-Yates shuffle
+        std::mt19937 mt(seed);
+        std::vector<long int> indexes(x.Row);
+        for(long int i = 0; i < x.Row; i += 1) {
+            indexes[i] = i;
+        }
+        for(long int i = 0; i < samples; i += 1) {
+            std::uniform_int_distribution<long int> pick(i, x.Row - 1);
+            std::swap(indexes[i], indexes[pick(mt)]);
+        }
+        SpotNum2D<double> n2d;
+        auto queries = n2d.Create(samples, x.Col);
+        std::vector<Label> queryLabels(samples);
+        for(long int i = 0; i < samples; i += 1) {
+            memcpy(queries[i], x[indexes[i]], sizeof(double) * x.Col);
+            queryLabels[i] = labels[indexes[i]];
+        }
+        auto scores = SilhouetteRows(queries, queryLabels.data(), x, labels, Clusters(labels), threads);
+
+        Estimate estimate;
+        estimate.Samples = samples;
+        for(long int i = 0; i < samples; i += 1) {
+            estimate.Score += scores[i];
+        }
+        estimate.Score /= samples;
+        double variance = 0;
+        for(long int i = 0; i < samples; i += 1) {
+            variance += (scores[i] - estimate.Score) * (scores[i] - estimate.Score);
+        }
+        variance /= std::max(1L, samples - 1);
+        double correction = (x.Row > 1) ? (double)(x.Row - samples) / (x.Row - 1) : 0;
+        double margin = z * sqrt(variance / samples * correction);
+        estimate.Lower = std::max(-1.0, estimate.Score - margin);
+        estimate.Upper = std::min(1.0, estimate.Score + margin);
+        return estimate;
+    }
+
+    ////////////////////////////////////////
+    // Davies-Bouldin, Calinski-Harabasz
+    ////////////////////////////////////////
+    // Mean over the clusters of the largest (S_i + S_j) / |c_i - c_j|, S the mean distance of a cluster's rows to
+    // its mean c. Lower is better; empty clusters are left out.
+    double DaviesBouldin(Num2D<double> x, Num1D<Label> labels) {
+        CheckLabels(x, labels);
+        const int clusters = Clusters(labels);
+        const auto sizes = ClusterSizes(labels, clusters);
+        const auto means = ClusterMeans(x, labels, sizes);
+        std::vector<double> spread(clusters, 0);
+        for(long int i = 0; i < x.Row; i += 1) {
+            spread[labels[i]] += sqrt(FixedDim<double, Dynamic>::SquaredDistance(x[i], means.data() + (long int)labels[i] * x.Col, x.Col));
+        }
+        double total = 0;
+        int used = 0;
+        for(int a = 0; a < clusters; a += 1) {
+            if(sizes[a] == 0) {
+                continue;
+            }
+            double worst = 0;
+            for(int b = 0; b < clusters; b += 1) {
+                if(b == a || sizes[b] == 0) {
+                    continue;
+                }
+                double gap = sqrt(FixedDim<double, Dynamic>::SquaredDistance(means.data() + (long int)a * x.Col, means.data() + (long int)b * x.Col, x.Col));
+                double ratio = (spread[a] / sizes[a] + spread[b] / sizes[b]) / gap;
+                worst = std::max(worst, (gap > 0) ? ratio : 0);
+            }
+            total += worst;
+            used += 1;
+        }
+        return total / std::max(1, used);
+    }
+
+    // Between-cluster over within-cluster dispersion, each divided by its degrees of freedom:
+    // (B / (k - 1)) / (W / (N - k)) with k the non-empty clusters. Higher is better; 1 for a single cluster.
+    double CalinskiHarabasz(Num2D<double> x, Num1D<Label> labels) {
+        CheckLabels(x, labels);
+        const int clusters = Clusters(labels);
+        const auto sizes = ClusterSizes(labels, clusters);
+        const auto means = ClusterMeans(x, labels, sizes);
+        std::vector<double> center(x.Col, 0);
+        for(long int i = 0; i < x.Row; i += 1) {
+            FixedDim<double, Dynamic>::Add(center.data(), x[i], x.Col);
+        }
+        for(long int n = 0; n < x.Col; n += 1) {
+            center[n] /= std::max(1L, x.Row);
+        }
+        double within = 0;
+        for(long int i = 0; i < x.Row; i += 1) {
+            within += FixedDim<double, Dynamic>::SquaredDistance(x[i], means.data() + (long int)labels[i] * x.Col, x.Col);
+        }
+        double between = 0;
+        long int k = 0;
+        for(int cluster = 0; cluster < clusters; cluster += 1) {
+            if(sizes[cluster] > 0) {
+                between += sizes[cluster] * FixedDim<double, Dynamic>::SquaredDistance(means.data() + (long int)cluster * x.Col, center.data(), x.Col);
+                k += 1;
+            }
+        }
+        if(k <= 1 || within == 0) {
+            return 1;
+        }
+        return (between / (k - 1)) / (within / (x.Row - k));
+    }
+};
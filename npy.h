@@ -0,0 +1,269 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+#include <type_traits>
+
+#include "numxd.h"
+
+// NumPy .npy compatible binary format.
+// Files written here load with numpy.load() and files from numpy.save() load here,
+// as long as they are little-endian. C ordered arrays map to RowMajor, Fortran ordered to ColMajor.
+namespace NPY {
+    class Header {
+        public:
+        std::string Descr;
+        bool FortranOrder;
+        std::vector<long int> Shape;
+        size_t DataOffset;
+        Header(): FortranOrder(false), DataOffset(0) {}
+    };
+
+    template <typename T>
+    std::string Descr() {
+        static_assert(std::is_arithmetic<T>::value, "npy supports arithmetic element types only");
+        std::string descr;
+        if(sizeof(T) == 1) {
+            descr += "|";
+        } else {
+            descr += "<";
+        }
+        if(std::is_floating_point<T>::value) {
+            descr += "f";
+        } else if(std::is_same<T, bool>::value) {
+            descr += "b";
+        } else if(std::is_signed<T>::value) {
+            descr += "i";
+        } else {
+            descr += "u";
+        }
+        descr += std::to_string(sizeof(T));
+        return descr;
+    }
+
+    // The header is padded with spaces so the data starts on a 64 byte boundary, like numpy does.
+    std::string MakeHeader(std::string descr, std::vector<long int> shape, bool fortranOrder = false) {
+        std::string dict = "{'descr': '" + descr + "', 'fortran_order': " + (fortranOrder ? "True" : "False") + ", 'shape': (";
+        for(auto dim = shape.begin(); dim != shape.end(); dim++) {
+            dict += std::to_string(*dim);
+            if(shape.size() == 1 || dim != shape.end() - 1) {
+                dict += ",";
+            }
+            if(dim != shape.end() - 1) {
+                dict += " ";
+            }
+        }
+        dict += "), }";
+
+        int version = 1;
+        size_t preamble = 6 + 2 + 2;
+        if(preamble + dict.size() + 1 > 65535) {
+            version = 2;
+            preamble = 6 + 2 + 4;
+        }
+        size_t total = (preamble + dict.size() + 1 + 63) / 64 * 64;
+        dict.append(total - preamble - dict.size() - 1, ' ');
+        dict += "\n";
+
+        std::string header("\x93NUMPY", 6);
+        header += (char)version;
+        header += (char)0;
+        uint32_t length = dict.size();
+        header += (char)(length & 0xff);
+        header += (char)((length >> 8) & 0xff);
+        if(version == 2) {
+            header += (char)((length >> 16) & 0xff);
+            header += (char)((length >> 24) & 0xff);
+        }
+        return header + dict;
+    }
+
+    std::string DictValue(const std::string& dict, const char* key) {
+        auto pos = dict.find(std::string("'") + key + "'");
+        if(pos == std::string::npos) {
+            throw Format("error in %s: %d, npy header has no %s", __FUNCTION__, __LINE__, key);
+        }
+        pos = dict.find(':', pos);
+        if(pos == std::string::npos) {
+            throw Format("error in %s: %d, broken npy header", __FUNCTION__, __LINE__);
+        }
+        pos = dict.find_first_not_of(' ', pos + 1);
+        size_t end;
+        if(dict[pos] == '(') {
+            end = dict.find(')', pos) + 1;
+        } else if(dict[pos] == '\'' || dict[pos] == '"') {
+            end = dict.find(dict[pos], pos + 1) + 1;
+        } else {
+            end = dict.find_first_of(",}", pos);
+        }
+        return dict.substr(pos, end - pos);
+    }
+
+    Header ParseHeader(const char* data, size_t size) {
+        if(size < 10 || memcmp(data, "\x93NUMPY", 6) != 0) {
+            throw Format("error in %s: %d, not a npy file", __FUNCTION__, __LINE__);
+        }
+        const uint8_t* p = (const uint8_t*)data;
+        int version = p[6];
+        size_t length;
+        size_t preamble;
+        if(version == 1) {
+            length = p[8] | (p[9] << 8);
+            preamble = 10;
+        } else if(version == 2 || version == 3) {
+            if(size < 12) {
+                throw Format("error in %s: %d, broken npy header", __FUNCTION__, __LINE__);
+            }
+            length = p[8] | (p[9] << 8) | (p[10] << 16) | ((size_t)p[11] << 24);
+            preamble = 12;
+        } else {
+            throw Format("error in %s: %d, unsupported npy version %d", __FUNCTION__, __LINE__, version);
+        }
+        if(preamble + length > size) {
+            throw Format("error in %s: %d, broken npy header", __FUNCTION__, __LINE__);
+        }
+
+        std::string dict(data + preamble, length);
+        Header header;
+        std::string descr = DictValue(dict, "descr");
+        header.Descr = descr.substr(1, descr.size() - 2);
+        header.FortranOrder = DictValue(dict, "fortran_order") == "True";
+        std::string shape = DictValue(dict, "shape");
+        for(size_t pos = 1; pos < shape.size(); ) {
+            size_t end = shape.find_first_of(",)", pos);
+            std::string dim = shape.substr(pos, end - pos);
+            if(dim.find_first_not_of(' ') != std::string::npos) {
+                header.Shape.push_back(std::stol(dim));
+            }
+            pos = end + 1;
+        }
+        header.DataOffset = preamble + length;
+        return header;
+    }
+
+    // Shape as (Row, Col); one dimensional arrays are read as a single column.
+    template <typename T, int Layout = RowMajor>
+    void CheckHeader(const Header& header, size_t size, long int* row, long int* col) {
+        if(!IsLittleEndian()) {
+            throw Format("error in %s: %d, npy requires a little-endian host", __FUNCTION__, __LINE__);
+        }
+        if(header.Descr != Descr<T>() && !(sizeof(T) == 1 && header.Descr.substr(1) == Descr<T>().substr(1))) {
+            throw Format("error in %s: %d, npy dtype %s does not match %s", __FUNCTION__, __LINE__, header.Descr.c_str(), Descr<T>().c_str());
+        }
+        if(header.FortranOrder != (Layout == ColMajor) && header.Shape.size() > 1) {
+            throw Format("error in %s: %d, npy fortran_order does not match the Num2D layout", __FUNCTION__, __LINE__);
+        }
+        if(header.Shape.size() == 1) {
+            *row = header.Shape[0];
+            *col = 1;
+        } else if(header.Shape.size() == 2) {
+            *row = header.Shape[0];
+            *col = header.Shape[1];
+        } else {
+            throw Format("error in %s: %d, npy with %d dimensions is not supported", __FUNCTION__, __LINE__, (int)header.Shape.size());
+        }
+        if(header.DataOffset + sizeof(T) * (*row) * (*col) > size) {
+            throw Format("error in %s: %d, npy data is truncated", __FUNCTION__, __LINE__);
+        }
+    }
+
+    ////////////////////////////////////////
+    // save
+    ////////////////////////////////////////
+    template <typename T>
+    int Save(const char* fileName, const T* value, std::vector<long int> shape, size_t count, bool fortranOrder = false) {
+        if(!IsLittleEndian()) {
+            return -1;
+        }
+        FILE* fp = fopen(fileName, "wb");
+        if(fp == NULL) {
+            return -1;
+        }
+        std::string header = MakeHeader(Descr<T>(), shape, fortranOrder);
+        int result = 0;
+        if(fwrite(header.data(), 1, header.size(), fp) != header.size()) {
+            result = -1;
+        } else if(count > 0 && fwrite(value, sizeof(T), count, fp) != count) {
+            result = -1;
+        }
+        if(fclose(fp) != 0) {
+            result = -1;
+        }
+        return result;
+    }
+
+    template <typename T, int Layout>
+    int Save(const char* fileName, Num2D<T, Layout> x) {
+        return Save(fileName, x.Value, {x.Row, x.Col}, (size_t)x.Row * x.Col, Layout == ColMajor);
+    }
+
+    template <typename T>
+    int Save(const char* fileName, Num1D<T> x) {
+        return Save(fileName, x.Value, {x.Count}, (size_t)x.Count);
+    }
+
+    ////////////////////////////////////////
+    // load
+    ////////////////////////////////////////
+    // Copying loads into a MemoryManager, for data that is going to be modified.
+    template <typename T, int Layout = RowMajor>
+    Num2D<T, Layout> Load2D(MemoryManager& mm, const char* fileName) {
+        MappedFile file(fileName);
+        auto header = ParseHeader(file.Data, file.Size);
+        long int row, col;
+        CheckHeader<T, Layout>(header, file.Size, &row, &col);
+        Num2D<T, Layout> n2d(mm);
+        auto dst = n2d.Create(row, col);
+        memcpy(dst.Value, file.Data + header.DataOffset, sizeof(T) * row * col);
+        return dst;
+    }
+
+    template <typename T>
+    Num1D<T> Load1D(MemoryManager& mm, const char* fileName) {
+        MappedFile file(fileName);
+        auto header = ParseHeader(file.Data, file.Size);
+        long int row, col;
+        CheckHeader<T>(header, file.Size, &row, &col);
+        Num1D<T> n1d(mm);
+        auto dst = n1d.Create(row * col);
+        memcpy(dst.Value, file.Data + header.DataOffset, sizeof(T) * row * col);
+        return dst;
+    }
+
+    // Zero-copy load: the Num2D points straight into the read-only mapping of the file,
+    // nothing is parsed or copied and pages are read on first touch.
+    // Like SpotNum2D it carries its own MemoryManager for temporaries; the mapping lives as long as this object.
+    template <typename T, int Layout = RowMajor>
+    class MappedNum2D: public Num2D<T, Layout> {
+        public:
+        MemoryManager mm;
+        std::unique_ptr<MappedFile> File;
+        MappedNum2D(const char* fileName): Num2D<T, Layout>(mm), File(new MappedFile(fileName)) {
+            auto header = ParseHeader(this->File->Data, this->File->Size);
+            long int row, col;
+            CheckHeader<T, Layout>(header, this->File->Size, &row, &col);
+            this->Row = row;
+            this->Col = col;
+            this->Value = (T*)(this->File->Data + header.DataOffset);
+        }
+        MappedNum2D(const MappedNum2D&) = delete;
+        MappedNum2D& operator=(const MappedNum2D&) = delete;
+    };
+
+    template <typename T>
+    class MappedNum1D: public Num1D<T> {
+        public:
+        MemoryManager mm;
+        std::unique_ptr<MappedFile> File;
+        MappedNum1D(const char* fileName): Num1D<T>(mm), File(new MappedFile(fileName)) {
+            auto header = ParseHeader(this->File->Data, this->File->Size);
+            long int row, col;
+            CheckHeader<T>(header, this->File->Size, &row, &col);
+            this->Count = row * col;
+            this->Value = (T*)(this->File->Data + header.DataOffset);
+        }
+        MappedNum1D(const MappedNum1D&) = delete;
+        MappedNum1D& operator=(const MappedNum1D&) = delete;
+    };
+};
@@ -1,21 +1,54 @@
 
 #pragma once
 
+#include <fcntl.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <map>
 #include <random>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "parallel.h"
+
 #define DPRT() printf("### %s %d\n", __FUNCTION__, __LINE__);
 
+// Checks are selected at build time with -DNUMXD_CHECK_LEVEL=n:
+//   0  release, no checks at all
+//   1  default, shapes of whole-array operations (Copy, + - /, Subtract, Division...) are checked
+//   2  debug, additionally every element access, slice and block is range checked
+#ifndef NUMXD_CHECK_LEVEL
+#define NUMXD_CHECK_LEVEL 1
+#endif
+const int CheckLevel = NUMXD_CHECK_LEVEL;
+
+#if NUMXD_CHECK_LEVEL >= 2
+#define NUMXD_CHECK_INDEX(index, count) \
+    if((index) < 0 || (index) >= (count)) { \
+        throw Format("error in %s: %d, index %ld is out of range [0, %ld)", __FUNCTION__, __LINE__, (long int)(index), (long int)(count)); \
+    }
+#define NUMXD_CHECK_RANGE(start, end, count) \
+    if((start) < 0 || (end) < (start) || (end) > (count)) { \
+        throw Format("error in %s: %d, range [%ld, %ld) is out of [0, %ld)", __FUNCTION__, __LINE__, (long int)(start), (long int)(end), (long int)(count)); \
+    }
+#else
+#define NUMXD_CHECK_INDEX(index, count)
+#define NUMXD_CHECK_RANGE(start, end, count)
+#endif
+
 const char* Format(const char* fmt, ...) {
     static char buffer[4096];
     va_list ap;
@@ -26,27 +59,172 @@ const char* Format(const char* fmt, ...) {
     return buffer;
 }
 
+// Storage order of Num2D, selected at compile time.
+// RowMajor keeps each sample contiguous (distance code), ColMajor keeps each feature contiguous (column statistics).
+enum NumLayout {
+    RowMajor = 0,
+    ColMajor = 1,
+};
+
+// Extents and indexes (Count, Row, Col, index arrays) are long int, so one matrix may hold more than 2^31 elements.
+// Cluster assignments are Label: 32 bits number any practical cluster count and halve what a predict pass streams.
+typedef int Label;
+
 template <typename T> class Num1D;
-template <typename T> class Num2D;
+template <typename T, int Layout = RowMajor> class Num2D;
+template <typename T> class View1D;
+template <typename T> class View2D;
+template <typename T> class IndexView2D;
+
+////////////////////////////////////////
+// memory statistics
+////////////////////////////////////////
+// Build with -DNUMXD_MEMORY_STATS to track live/peak bytes, reuse hits, oversize waste, a histogram of
+// request sizes and per-tag counters in MemoryManager. Without it none of the bookkeeping is compiled and
+// Snapshot() only reports the counters MemoryManager always keeps.
+class MemoryTagStats {
+    public:
+    std::string Name;
+    long int Requests;
+    long int Misses;
+    size_t Bytes;
+    MemoryTagStats(): Requests(0), Misses(0), Bytes(0) {}
+};
+
+class MemorySnapshot {
+    public:
+    bool Enabled;
+    long int Blocks;
+    long int BlocksInUse;
+    size_t PooledBytes;
+    size_t IdleBytes;
+    size_t LiveBytes;
+    size_t PeakBytes;
+    size_t WastedBytes;
+    long int Requests;
+    long int ReuseHits;
+    long int ReuseMisses;
+    long int Releases;
+    // Histogram[i] counts requests of [2^(i-1), 2^i) bytes
+    std::vector<long int> Histogram;
+    std::vector<MemoryTagStats> Tags;
+    MemorySnapshot():
+        Enabled(false), Blocks(0), BlocksInUse(0), PooledBytes(0), IdleBytes(0), LiveBytes(0), PeakBytes(0), WastedBytes(0),
+        Requests(0), ReuseHits(0), ReuseMisses(0), Releases(0), Histogram(65, 0) {}
+    
+    double ReuseHitRate() {
+        return (this->Requests > 0) ? (double)this->ReuseHits / this->Requests : 0;
+    }
+    
+    std::string Json() {
+        std::ostringstream os;
+        os << "{\"enabled\": " << (this->Enabled ? "true" : "false");
+        os << ", \"blocks\": " << this->Blocks << ", \"blocks_in_use\": " << this->BlocksInUse;
+        os << ", \"pooled_bytes\": " << this->PooledBytes << ", \"idle_bytes\": " << this->IdleBytes;
+        os << ", \"live_bytes\": " << this->LiveBytes << ", \"peak_bytes\": " << this->PeakBytes;
+        os << ", \"wasted_bytes\": " << this->WastedBytes << ", \"requests\": " << this->Requests;
+        os << ", \"reuse_hits\": " << this->ReuseHits << ", \"reuse_misses\": " << this->ReuseMisses;
+        os << ", \"reuse_hit_rate\": " << this->ReuseHitRate() << ", \"releases\": " << this->Releases;
+        os << ", \"histogram\": {";
+        bool first = true;
+        for(unsigned int i = 0; i < this->Histogram.size(); i++) {
+            if(this->Histogram[i] > 0) {
+                os << (first ? "" : ", ") << "\"" << ((i == 0) ? 0 : ((size_t)1 << (i - 1))) << "\": " << this->Histogram[i];
+                first = false;
+            }
+        }
+        os << "}, \"tags\": [";
+        for(auto tag = this->Tags.begin(); tag != this->Tags.end(); tag++) {
+            os << ((tag == this->Tags.begin()) ? "" : ", ");
+            os << "{\"name\": \"" << tag->Name << "\", \"requests\": " << tag->Requests;
+            os << ", \"misses\": " << tag->Misses << ", \"bytes\": " << tag->Bytes << "}";
+        }
+        os << "]}";
+        return os.str();
+    }
+};
 
 class MemoryManager {
     public:
     std::vector<void*> Pointer;
     std::vector<size_t> Size;
     std::vector<int> InUse;
-    int ReleaseCount;
-    int ReUseCount;
+    std::vector<int> Mapped;
+    long int ReleaseCount;
+    long int ReUseCount;
+    // allocations that needed a new block
+    long int MissCount;
+    size_t BackingThreshold;
+    std::string BackingDirectory;
+#ifdef NUMXD_MEMORY_STATS
+    std::vector<size_t> Requested;
+    MemorySnapshot Stats;
+    std::map<std::string, MemoryTagStats> TagStats;
+    const char* CurrentTag;
+#endif
     MemoryManager() {
         this->ReleaseCount = 0;
         this->ReUseCount = 0;
+        this->MissCount = 0;
+        this->BackingThreshold = 0;
+#ifdef NUMXD_MEMORY_STATS
+        this->Stats.Enabled = true;
+        this->CurrentTag = NULL;
+#endif
     }
     ~MemoryManager() {
-        for(auto iter = this->Pointer.begin(); iter != this->Pointer.end(); iter++) {
-            free(*iter);
+        for(unsigned int i = 0; i < this->Pointer.size(); i++) {
+            this->FreeBlock(i);
         }
         //this->Report();
     }
     
+    ////////////////////////////////////////
+    // backing store
+    ////////////////////////////////////////
+    // Allocations of threshold bytes or more are served from memory-mapped temp files in directory,
+    // so the page cache can write them back to disk under memory pressure. threshold == 0 disables it.
+    void SetBackingStore(const char* directory, size_t threshold) {
+        this->BackingDirectory = directory;
+        this->BackingThreshold = threshold;
+    }
+    
+    void* MapTemp(size_t size) {
+        std::string path = this->BackingDirectory + "/numxd-XXXXXX";
+        int fd = mkstemp(&path[0]);
+        if(fd < 0) {
+            throw Format("error in %s: %d, mkstemp failed, path=%s", __FUNCTION__, __LINE__, path.c_str());
+        }
+        unlink(path.c_str());
+        if(ftruncate(fd, size) != 0) {
+            close(fd);
+            throw Format("error in %s: %d, ftruncate failed, size=%ld", __FUNCTION__, __LINE__, size);
+        }
+        void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(p == MAP_FAILED) {
+            throw Format("error in %s: %d, mmap failed, size=%ld", __FUNCTION__, __LINE__, size);
+        }
+        madvise(p, size, MADV_SEQUENTIAL);
+        return p;
+    }
+    
+    // madvise hint for a file-backed block, e.g. MADV_WILLNEED before a pass or MADV_DONTNEED after it.
+    void Advise(void* p, int advice) {
+        auto index = this->FindPointer(p);
+        if(this->Mapped[index]) {
+            madvise(p, this->Size[index], advice);
+        }
+    }
+    
+    void FreeBlock(long int index) {
+        if(this->Mapped[index]) {
+            munmap(this->Pointer[index], this->Size[index]);
+        } else {
+            free(this->Pointer[index]);
+        }
+    }
+    
     void Report() {
         std::cout << "### Memory report"  << std::endl;
         for(unsigned int i = 0; i < this->Pointer.size(); i++) {
@@ -55,12 +233,81 @@ class MemoryManager {
         std::cout << "release count: " << this->ReleaseCount << std::endl;
         std::cout << "reuse count: " << this->ReUseCount << std::endl;
         std::cout << "alloc count: " << this->Pointer.size() << std::endl;
+#ifdef NUMXD_MEMORY_STATS
+        std::cout << "stats: " << this->Snapshot().Json() << std::endl;
+#endif
     }
     
-    int FindMemory(size_t size) {
+    ////////////////////////////////////////
+    // statistics
+    ////////////////////////////////////////
+    MemorySnapshot Snapshot() {
+#ifdef NUMXD_MEMORY_STATS
+        MemorySnapshot snapshot = this->Stats;
+        for(auto tag = this->TagStats.begin(); tag != this->TagStats.end(); tag++) {
+            snapshot.Tags.push_back(tag->second);
+        }
+#else
+        MemorySnapshot snapshot;
+        snapshot.Requests = this->ReUseCount + this->MissCount;
+        snapshot.ReuseHits = this->ReUseCount;
+        snapshot.ReuseMisses = this->MissCount;
+        snapshot.Releases = this->ReleaseCount;
+#endif
+        snapshot.Blocks = this->Pointer.size();
+        for(unsigned int i = 0; i < this->Pointer.size(); i++) {
+            snapshot.PooledBytes += this->Size[i];
+            if(this->InUse[i]) {
+                snapshot.BlocksInUse += 1;
+            } else {
+                snapshot.IdleBytes += this->Size[i];
+            }
+        }
+        return snapshot;
+    }
+    
+#ifdef NUMXD_MEMORY_STATS
+    void RecordAlloc(long int index, size_t size, bool reused, const char* tag) {
+        this->Requested[index] = size;
+        this->Stats.Requests += 1;
+        if(reused) {
+            this->Stats.ReuseHits += 1;
+            this->Stats.WastedBytes += this->Size[index] - size;
+        } else {
+            this->Stats.ReuseMisses += 1;
+        }
+        this->Stats.LiveBytes += size;
+        this->Stats.PeakBytes = std::max(this->Stats.PeakBytes, this->Stats.LiveBytes);
+        int bucket = 0;
+        while(bucket < 64 && ((size_t)1 << bucket) <= size) {
+            bucket += 1;
+        }
+        this->Stats.Histogram[bucket] += 1;
+        
+        if(tag == NULL) {
+            tag = this->CurrentTag;
+        }
+        if(tag != NULL) {
+            auto& stats = this->TagStats[tag];
+            stats.Name = tag;
+            stats.Requests += 1;
+            stats.Misses += reused ? 0 : 1;
+            stats.Bytes += size;
+        }
+    }
+    
+    void RecordRelease(long int index) {
+        this->Stats.Releases += 1;
+        this->Stats.LiveBytes -= this->Requested[index];
+        this->Stats.WastedBytes -= this->Size[index] - this->Requested[index];
+        this->Requested[index] = 0;
+    }
+#endif
+    
+    long int FindMemory(size_t size) {
         for(auto iter = this->Size.begin(); iter != this->Size.end(); iter++) {
             if(*iter >= size) {
-                int index = std::distance(this->Size.begin(), iter);;
+                long int index = std::distance(this->Size.begin(), iter);
                 if(this->InUse[index] == 0) {
                     return index;
                 }
@@ -69,26 +316,43 @@ class MemoryManager {
         return -1;
     }
     
-    void Append(void* p, size_t size) {
+    void Append(void* p, size_t size, int mapped = 0) {
         this->Pointer.push_back(p);
         this->Size.push_back(size);
         this->InUse.push_back(1);
+        this->Mapped.push_back(mapped);
+#ifdef NUMXD_MEMORY_STATS
+        this->Requested.push_back(0);
+#endif
     }
     
-    void* Alloc(size_t size) {
+    // tag names the call site in the statistics, NULL falls back to the innermost MemoryTag.
+    void* Alloc(size_t size, const char* tag = NULL) {
         auto index = this->FindMemory(size);
-        if(index >= 0) {
+        const bool reused = (index >= 0);
+        void* p;
+        if(reused) {
             this->ReUseCount += 1;
             this->InUse[index] = 1;
-            return this->Pointer[index];
+            p = this->Pointer[index];
+        } else if(this->BackingThreshold > 0 && size >= this->BackingThreshold) {
+            this->MissCount += 1;
+            p = this->MapTemp(size);
+            this->Append(p, size, 1);
         } else {
-            void* p = malloc(size);
+            this->MissCount += 1;
+            p = malloc(size);
             if(p == NULL) {
                 throw Format("error in %s: %d, malloc failed, size=%ld", __FUNCTION__, __LINE__, size);
             }
             this->Append(p, size);
-            return p;
         }
+#ifdef NUMXD_MEMORY_STATS
+        this->RecordAlloc(reused ? index : this->Pointer.size() - 1, size, reused, tag);
+#else
+        (void)tag;
+#endif
+        return p;
     }
     
     /*
@@ -117,6 +381,9 @@ class MemoryManager {
         auto index = this->FindPointer(p);
         this->ReleaseCount += 1;
         this->InUse[index] = 0;
+#ifdef NUMXD_MEMORY_STATS
+        this->RecordRelease(index);
+#endif
     }
     
 
@@ -125,36 +392,109 @@ class MemoryManager {
         this->Release(a.Value);
     }
     
-    template <typename T>
-    void Release(Num2D<T>& a) {
+    template <typename T, int Layout>
+    void Release(Num2D<T, Layout>& a) {
         this->Release(a.Value);
     }
     
     void Free(void* p) {
         auto index = this->FindPointer(p);
-        free(this->Pointer[index]);
+#ifdef NUMXD_MEMORY_STATS
+        if(this->InUse[index]) {
+            this->RecordRelease(index);
+        }
+        this->Requested.erase(this->Requested.begin() + index);
+#endif
+        this->FreeBlock(index);
         this->Pointer.erase(this->Pointer.begin() + index);
         this->Size.erase(this->Size.begin() + index);
         this->InUse.erase(this->InUse.begin() + index);
+        this->Mapped.erase(this->Mapped.begin() + index);
+    }
+};
+
+// Attributes every allocation of mm inside the scope to tag, e.g. MemoryTag tag(this->mm, "KMeans::EStep");
+class MemoryTag {
+    public:
+    MemoryManager& mm;
+    const char* Previous;
+    MemoryTag(MemoryManager& memoryManager, const char* tag): mm(memoryManager), Previous(NULL) {
+#ifdef NUMXD_MEMORY_STATS
+        this->Previous = this->mm.CurrentTag;
+        this->mm.CurrentTag = tag;
+#else
+        (void)tag;
+#endif
+    }
+    ~MemoryTag() {
+#ifdef NUMXD_MEMORY_STATS
+        this->mm.CurrentTag = this->Previous;
+#endif
+    }
+};
+
+// The npy and snapshot formats are little-endian and only written or mapped on such hosts.
+inline bool IsLittleEndian() {
+    const uint16_t one = 1;
+    return *(const uint8_t*)&one == 1;
+}
+
+class MappedFile {
+    public:
+    size_t Size;
+    char* Data;
+    MappedFile(const char* fileName): Size(0), Data(NULL) {
+        int fd = open(fileName, O_RDONLY);
+        if(fd < 0) {
+            throw Format("error in %s: %d, %s open failed.", __FUNCTION__, __LINE__, fileName);
+        }
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            close(fd);
+            throw Format("error in %s: %d, %s stat failed.", __FUNCTION__, __LINE__, fileName);
+        }
+        this->Size = st.st_size;
+        if(this->Size > 0) {
+            void* p = mmap(NULL, this->Size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p == MAP_FAILED) {
+                close(fd);
+                throw Format("error in %s: %d, %s mmap failed, size=%ld", __FUNCTION__, __LINE__, fileName, this->Size);
+            }
+            this->Data = (char*)p;
+        }
+        close(fd);
+    }
+    ~MappedFile() {
+        if(this->Data != NULL) {
+            munmap(this->Data, this->Size);
+        }
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    void Advise(int advice) {
+        if(this->Data != NULL) {
+            madvise(this->Data, this->Size, advice);
+        }
     }
 };
 
 template <typename T>
 class ValueWithIndex {
     public:
-    int Index;
+    long int Index;
     T Value;
 };
 
 template <typename T>
 class SortValueWithIndex {
     public:
-    int Count;
+    long int Count;
     ValueWithIndex<T> *X;
-    SortValueWithIndex(int count, T* value) {
+    SortValueWithIndex(long int count, T* value) {
         this->Count = count;
         this->X = (ValueWithIndex<T>*)malloc(sizeof(ValueWithIndex<T>) * this->Count);
-        for(int i = 0; i < this->Count; i++) {
+        for(long int i = 0; i < this->Count; i++) {
             this->X[i].Index = i;
             this->X[i].Value = value[i];
         }
@@ -179,18 +519,315 @@ class SortValueWithIndex {
     }
 };
 
+////////////////////////////////////////
+// fixed dimension
+////////////////////////////////////////
+// Row kernels over D features. With D known at compile time the loops are expanded into straight-line code
+// that keeps a whole row in registers, Dynamic falls back to a loop over the runtime column count.
+const int Dynamic = -1;
+
+template <typename T, int D>
+class FixedDim {
+    public:
+    static_assert(D == Dynamic || D > 0, "FixedDim needs a positive dimension");
+    
+    static int Dim(int col) {
+        return (D == Dynamic) ? col : D;
+    }
+    
+    // Once per kernel call, the per-row code never looks at col for a fixed D.
+    static void CheckDim(int col) {
+        if(CheckLevel >= 1 && D != Dynamic && col != D) {
+            throw Format("error in %s: %d, kernel for %d columns called with %d", __FUNCTION__, __LINE__, D, col);
+        }
+    }
+    
+    template <size_t... I>
+    static T SquaredDistanceUnrolled(const T* a, const T* b, std::index_sequence<I...>) {
+        T d[sizeof...(I)] = {(a[I] - b[I])...};
+        T total = 0;
+        ((total += d[I] * d[I]), ...);
+        return total;
+    }
+    static T SquaredDistance(const T* a, const T* b, int col) {
+        if constexpr (D != Dynamic) {
+            return SquaredDistanceUnrolled(a, b, std::make_index_sequence<D>());
+        } else {
+            T total = 0;
+            for(int n = 0; n < col; n += 1) {
+                T d = a[n] - b[n];
+                total += d * d;
+            }
+            return total;
+        }
+    }
+    
+    template <size_t... I>
+    static void AddUnrolled(T* dst, const T* src, std::index_sequence<I...>) {
+        ((dst[I] += src[I]), ...);
+    }
+    static void Add(T* dst, const T* src, int col) {
+        if constexpr (D != Dynamic) {
+            AddUnrolled(dst, src, std::make_index_sequence<D>());
+        } else {
+            for(int n = 0; n < col; n += 1) {
+                dst[n] += src[n];
+            }
+        }
+    }
+};
+
+// Call f(std::integral_constant<int, D>()) with D == col for the common small feature counts, Dynamic otherwise.
+template <typename F>
+auto DispatchDim(int col, F f) {
+    switch(col) {
+        case 1: return f(std::integral_constant<int, 1>());
+        case 2: return f(std::integral_constant<int, 2>());
+        case 3: return f(std::integral_constant<int, 3>());
+        case 4: return f(std::integral_constant<int, 4>());
+        case 5: return f(std::integral_constant<int, 5>());
+        case 6: return f(std::integral_constant<int, 6>());
+        case 7: return f(std::integral_constant<int, 7>());
+        case 8: return f(std::integral_constant<int, 8>());
+        case 9: return f(std::integral_constant<int, 9>());
+        case 10: return f(std::integral_constant<int, 10>());
+        case 11: return f(std::integral_constant<int, 11>());
+        case 12: return f(std::integral_constant<int, 12>());
+        case 13: return f(std::integral_constant<int, 13>());
+        case 14: return f(std::integral_constant<int, 14>());
+        case 15: return f(std::integral_constant<int, 15>());
+        case 16: return f(std::integral_constant<int, 16>());
+        case 24: return f(std::integral_constant<int, 24>());
+        case 32: return f(std::integral_constant<int, 32>());
+        default: return f(std::integral_constant<int, Dynamic>());
+    }
+}
+
+////////////////////////////////////////
+// reduction
+////////////////////////////////////////
+enum ReduceOp {
+    ReduceSum,
+    ReduceMin,
+    ReduceMax,
+    ReduceMean,
+    ReduceArgMin,
+    ReduceArgMax,
+};
+
+// One engine behind every Total/Mean/ArgMin.
+// The input is a set of lines: element i of line j is Value[j * LineStride + i * ElemStride], 0 <= i < Len.
+// Contiguous lines (ElemStride == 1) are summed pairwise in blocks with 8 independent accumulators,
+// strided lines are walked a tile of lines at a time with per-line block sums added Kahan-compensated.
+// The inner loops are plain unit-stride loops the compiler can vectorize.
+namespace Reduction {
+    const long int Block = 128;
+    const long int TileLines = 256;
+    // below this many lines a parallel reduction splits the lines themselves
+    const long int SplitLinesMin = 64;
+    
+    template <typename T>
+    class Lines {
+        public:
+        const T* Value;
+        long int Count;
+        long int Len;
+        long int LineStride;
+        long int ElemStride;
+        Lines(const T* value, long int count, long int len, long int lineStride, long int elemStride):
+            Value(value), Count(count), Len(len), LineStride(lineStride), ElemStride(elemStride) {}
+    };
+    
+    template <typename T>
+    T PairwiseSum(const T* p, long int n) {
+        if(n <= Block) {
+            T acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+            long int i = 0;
+            for(; i + 8 <= n; i += 8) {
+                for(int k = 0; k < 8; k += 1) {
+                    acc[k] += p[i + k];
+                }
+            }
+            T total = ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+            for(; i < n; i += 1) {
+                total += p[i];
+            }
+            return total;
+        }
+        long int half = n / 2;
+        half -= half % 8;
+        return PairwiseSum(p, half) + PairwiseSum(p + half, n - half);
+    }
+    
+    template <typename T>
+    void KahanAdd(T& sum, T& comp, T value) {
+        if constexpr (std::is_floating_point<T>::value) {
+            T y = value - comp;
+            T t = sum + y;
+            comp = (t - sum) - y;
+            sum = t;
+        } else {
+            sum += value;
+        }
+    }
+    
+    template <typename T>
+    bool Better(int op, T a, T b) {
+        return (op == ReduceMin || op == ReduceArgMin) ? a < b : a > b;
+    }
+    
+    // Reduce elements [begin, end) of lines [lineBegin, lineEnd) into value/index (indexed by line).
+    template <typename T>
+    void Partial(Lines<T> x, int op, long int lineBegin, long int lineEnd, long int begin, long int end, T* value, long int* index) {
+        const bool isSum = (op == ReduceSum || op == ReduceMean);
+        if(x.ElemStride == 1) {
+            for(long int j = lineBegin; j < lineEnd; j += 1) {
+                const T* p = x.Value + j * x.LineStride;
+                if(isSum) {
+                    value[j] = PairwiseSum(p + begin, end - begin);
+                    continue;
+                }
+                T best = p[begin];
+                long int bestIndex = begin;
+                for(long int i = begin + 1; i < end; i += 1) {
+                    if(Better(op, p[i], best)) {
+                        best = p[i];
+                        bestIndex = i;
+                    }
+                }
+                value[j] = best;
+                if(index != NULL) {
+                    index[j] = bestIndex;
+                }
+            }
+            return;
+        }
+        
+        for(long int j0 = lineBegin; j0 < lineEnd; j0 += TileLines) {
+            const long int tile = std::min(lineEnd, j0 + TileLines) - j0;
+            T sum[TileLines];
+            T comp[TileLines];
+            T part[TileLines];
+            long int bestIndex[TileLines];
+            const T* first = x.Value + begin * x.ElemStride + j0 * x.LineStride;
+            for(long int j = 0; j < tile; j += 1) {
+                sum[j] = isSum ? 0 : first[j * x.LineStride];
+                comp[j] = 0;
+                bestIndex[j] = begin;
+            }
+            for(long int i0 = begin; i0 < end; i0 += Block) {
+                const long int i1 = std::min(end, i0 + Block);
+                if(isSum) {
+                    for(long int j = 0; j < tile; j += 1) {
+                        part[j] = 0;
+                    }
+                }
+                for(long int i = i0; i < i1; i += 1) {
+                    const T* p = x.Value + i * x.ElemStride + j0 * x.LineStride;
+                    if(isSum) {
+                        if(x.LineStride == 1) {
+                            for(long int j = 0; j < tile; j += 1) {
+                                part[j] += p[j];
+                            }
+                        } else {
+                            for(long int j = 0; j < tile; j += 1) {
+                                part[j] += p[j * x.LineStride];
+                            }
+                        }
+                    } else {
+                        for(long int j = 0; j < tile; j += 1) {
+                            T v = p[j * x.LineStride];
+                            if(Better(op, v, sum[j])) {
+                                sum[j] = v;
+                                bestIndex[j] = i;
+                            }
+                        }
+                    }
+                }
+                if(isSum) {
+                    for(long int j = 0; j < tile; j += 1) {
+                        KahanAdd(sum[j], comp[j], part[j]);
+                    }
+                }
+            }
+            for(long int j = 0; j < tile; j += 1) {
+                value[j0 + j] = sum[j];
+                if(index != NULL) {
+                    index[j0 + j] = bestIndex[j];
+                }
+            }
+        }
+    }
+    
+    // value must hold x.Count elements, so must index unless it is NULL; index is filled by the min/max ops only.
+    // threads <= 0 uses Parallel::Threads(). Large inputs are cut into chunks that depend only on the shape,
+    // so the result does not change with the thread count.
+    template <typename T>
+    void Reduce(Lines<T> x, int op, int threads, T* value, long int* index) {
+        const bool isSum = (op == ReduceSum || op == ReduceMean);
+        if(x.Len <= 0) {
+            if(!isSum) {
+                throw Format("error in %s: %d, reduction of an empty axis", __FUNCTION__, __LINE__);
+            }
+            for(long int j = 0; j < x.Count; j += 1) {
+                value[j] = 0;
+            }
+            return;
+        }
+        if(x.Count * x.Len < Parallel::MinWork) {
+            Partial(x, op, 0, x.Count, 0, x.Len, value, index);
+        } else if(x.Count >= SplitLinesMin) {
+            Parallel::ParallelFor(0, x.Count, std::max(1L, Parallel::MinWork / x.Len), [&](long int lineBegin, long int lineEnd) {
+                Partial(x, op, lineBegin, lineEnd, 0, x.Len, value, index);
+            }, threads);
+        } else {
+            // few long lines: every chunk reduces a range of each line, the partials are combined in order
+            Parallel::Range range(0, x.Len, std::max(Block, Parallel::MinWork / x.Count));
+            std::vector<T> values(x.Count * range.Chunks);
+            std::vector<long int> indexes(x.Count * range.Chunks);
+            Parallel::ForChunks(range, [&](long int c, long int begin, long int end) {
+                // Partial writes by line index, so shift the output to this chunk's slot
+                Partial(x, op, 0, x.Count, begin, end, values.data() + x.Count * c, indexes.data() + x.Count * c);
+            }, threads);
+            for(long int j = 0; j < x.Count; j += 1) {
+                T sum = values[j];
+                T comp = 0;
+                long int bestIndex = indexes[j];
+                for(long int c = 1; c < range.Chunks; c += 1) {
+                    T v = values[x.Count * c + j];
+                    if(isSum) {
+                        KahanAdd(sum, comp, v);
+                    } else if(Better(op, v, sum)) {
+                        sum = v;
+                        bestIndex = indexes[x.Count * c + j];
+                    }
+                }
+                value[j] = sum;
+                if(index != NULL) {
+                    index[j] = bestIndex;
+                }
+            }
+        }
+        if(op == ReduceMean) {
+            for(long int j = 0; j < x.Count; j += 1) {
+                value[j] = value[j] / (T)x.Len;
+            }
+        }
+    }
+};
+
 template <typename T>
 class Num1D {
     public:
-    int Count;
+    long int Count;
     T* Value;
     MemoryManager& mm;
     Num1D(MemoryManager& memoryManager): Count(0), Value(NULL), mm(memoryManager) {}
-    Num1D(MemoryManager& memoryManager, int count, T* value): Count(count), Value(value), mm(memoryManager) {}
+    Num1D(MemoryManager& memoryManager, long int count, T* value): Count(count), Value(value), mm(memoryManager) {}
     
-    void ThrowDifferentCount(Num1D a, Num1D b) {
-        if(a.Count != b.Count) {
-            throw Format("error in %s: %d, different Num1D count %d != %d" , __FUNCTION__, __LINE__, a.Count, b.Count);
+    void ThrowDifferentCount(const Num1D& a, const Num1D& b) {
+        if(CheckLevel >= 1 && a.Count != b.Count) {
+            throw Format("error in %s: %d, different Num1D count %ld != %ld" , __FUNCTION__, __LINE__, a.Count, b.Count);
         }
     }
     
@@ -201,14 +838,15 @@ class Num1D {
         return *this;
     }
     
-    T& operator[](int index) {
+    T& operator[](long int index) {
+        NUMXD_CHECK_INDEX(index, this->Count);
         return this->Value[index];
     }
     
     Num1D operator+(Num1D b) {
         this->ThrowDifferentCount(*this, b);
         auto answer = this->Clone(*this);
-        for(int i = 0; i < this->Count; i += 1) {
+        for(long int i = 0; i < this->Count; i += 1) {
             answer[i] += b[i];
         }
         return answer;
@@ -217,7 +855,7 @@ class Num1D {
     Num1D operator-(Num1D b) {
         this->ThrowDifferentCount(*this, b);
         auto answer = this->Clone(*this);
-        for(int i = 0; i < this->Count; i += 1) {
+        for(long int i = 0; i < this->Count; i += 1) {
             answer[i] -= b[i];
         }
         return answer;
@@ -226,7 +864,7 @@ class Num1D {
     Num1D operator/(Num1D b) {
         this->ThrowDifferentCount(*this, b);
         auto answer = this->Clone(*this);
-        for(int i = 0; i < this->Count; i += 1) {
+        for(long int i = 0; i < this->Count; i += 1) {
             answer[i] /= b[i];
         }
         return answer;
@@ -234,13 +872,13 @@ class Num1D {
     
     Num1D operator/(T r) {
         auto answer = this->Clone(*this);
-        for(int i = 0; i < this->Count; i += 1) {
+        for(long int i = 0; i < this->Count; i += 1) {
             answer[i] /= r;
         }
         return answer;
     }
     
-    Num1D Create(int count) {
+    Num1D Create(long int count) {
         Num1D dst(this->mm, count, (T*)this->mm.Alloc(sizeof(T) * count));
         return dst;
     }
@@ -270,41 +908,41 @@ class Num1D {
         Num1D dst(this->mm);
         return dst;
     }
-    Num1D Full(int count, T value) {
+    Num1D Full(long int count, T value) {
         auto dst = this->Create(count);
-        for(int i = 0; i < dst.Count; i += 1) {
+        for(long int i = 0; i < dst.Count; i += 1) {
             dst[i] = value;
         }
         return dst;
     }
-    Num1D Zeros(int count) {
+    Num1D Zeros(long int count) {
         return this->Full(count, 0);
     }
-    Num1D Arange(int start, int end, int step = 1) {
-        int count = end - start;
+    Num1D Arange(long int start, long int end, long int step = 1) {
+        long int count = end - start;
         auto dst = this->Create(count);
-        for(int i = 0; i < count; i += 1) {
+        for(long int i = 0; i < count; i += 1) {
             dst[i] = start + i * step;
         }
         return dst;
     }
     
-    Num1D Random(int count, std::int32_t min, std::int32_t max) {
+    Num1D Random(long int count, std::int32_t min, std::int32_t max) {
         auto dst = this->Create(count);
         std::mt19937 mt;
         //mt.seed(0);
-        for(int i = 0; i < dst.Count; i += 1) {
+        for(long int i = 0; i < dst.Count; i += 1) {
             dst[i] = (((double)mt() / (double)std::mt19937::max()) * ((double)max - (double)min) ) + (double)min;
         }
         return dst;
     }
     
-    Num1D<int> ArgSort(Num1D src) {
+    Num1D<long int> ArgSort(Num1D src) {
         SortValueWithIndex<T> sorter(src.Count, src.Value);
         sorter.Sort();
-        Num1D<int> n1d(this->mm);
+        Num1D<long int> n1d(this->mm);
         auto dst = n1d.Create(src.Count);
-        for(int i = 0; i < src.Count; i += 1) {
+        for(long int i = 0; i < src.Count; i += 1) {
             dst[i] = sorter.X[i].Index;
         }
         return dst;
@@ -313,7 +951,7 @@ class Num1D {
     Num1D Sort(Num1D src) {
         auto indexes = this->ArgSort(src);
         auto dst = this->Create(src.Count);
-        for(int i = 0; i < src.Count; i += 1) {
+        for(long int i = 0; i < src.Count; i += 1) {
             dst[i] = src[indexes[i]];
         }
         indexes.Release();
@@ -324,7 +962,7 @@ class Num1D {
         auto rnd = this->Random(src.Count, 0, std::numeric_limits<int32_t>::max());
         auto indexes = this->ArgSort(rnd);
         auto dst = this->Create(src.Count);
-        for(int i = 0; i < src.Count; i += 1) {
+        for(long int i = 0; i < src.Count; i += 1) {
             dst[i] = src[indexes[i]];
         }
         rnd.Release();
@@ -337,35 +975,36 @@ class Num1D {
     ////////////////////////////////////////
     // Operation
     ////////////////////////////////////////
-    Num1D Slice(Num1D src, int start, int end) {
-        int count = end - start;
+    Num1D Slice(Num1D src, long int start, long int end) {
+        long int count = end - start;
         auto dst = this->Create(count);
-        for(int i = 0; i < count; i++) {
+        for(long int i = 0; i < count; i++) {
             dst[i] = src[start + i];
         }
         return dst;
     }
+    View1D<T> SliceView(long int start, long int end, long int step = 1) {
+        NUMXD_CHECK_RANGE(start, end, this->Count);
+        return View1D<T>(this->mm, (end - start + step - 1) / step, step, this->Value + start);
+    }
     
     ////////////////////////////////////////
     // 
     ////////////////////////////////////////
-    int ArgMin(Num1D x) {
-        auto indexes = this->ArgSort(x);
-        int idx = indexes[0];
-        indexes.Release();
-        return idx;
+    long int ArgMin(Num1D x) {
+        return x.ArgReduce(ReduceArgMin);
     }
-    Num1D<int> WhereEq(Num1D x, T n) {
-        int count = 0;
-        for(int i = 0; i < x.Count; i += 1) {
+    Num1D<long int> WhereEq(Num1D x, T n) {
+        long int count = 0;
+        for(long int i = 0; i < x.Count; i += 1) {
             if(x[i] == n) {
                 count += 1;
             }
         }
-        Num1D<int> n1d(this->mm);
+        Num1D<long int> n1d(this->mm);
         auto idxs = n1d.Create(count);
-        int idx = 0;
-        for(int i = 0; i < x.Count; i += 1) {
+        long int idx = 0;
+        for(long int i = 0; i < x.Count; i += 1) {
             if(x[i] == n) {
                 idxs[idx] = i;
                 idx += 1;
@@ -383,7 +1022,7 @@ class Num1D {
     
     Num1D Power(double b) {
         auto dst = this->Clone(*this);
-        for(int i = 0; i < dst.Count; i += 1) {
+        for(long int i = 0; i < dst.Count; i += 1) {
             dst[i] = (T)powf((double)dst[i], b);
         }
         return dst;
@@ -391,41 +1030,68 @@ class Num1D {
     
     Num1D Sqrt() {
         auto dst = this->Clone(*this);
-        for(int i = 0; i < dst.Count; i += 1) {
+        for(long int i = 0; i < dst.Count; i += 1) {
             dst[i] = (T)sqrt((double)dst[i]);
         }
         return dst;
     }
     
     T Total(Num1D x) {
-        T total = 0;
-        for(int i = 0; i < x.Count; i += 1) {
-            total += x[i];
-        }
-        return total;
+        return x.Reduce(ReduceSum);
     }
     
     T Mean() {
-        T total = 0;
-        for(int i = 0; i < this->Count; i += 1) {
-            total += (*this)[i];
-        }
-        return total / this->Count;
+        return this->Reduce(ReduceMean);
     }
     
     T CalcDistance(Num1D a, Num1D b) {
-        auto subtract = a - b;
-        auto power = subtract.Power(2);
-        T total = this->Total(power);
-        subtract.Release();
-        power.Release();
+        return this->CalcDistance(View1D<T>(a), View1D<T>(b));
+    }
+    
+    ////////////////////////////////////////
+    // Reduction
+    ////////////////////////////////////////
+    // ReduceArgMin/ReduceArgMax give the index converted to T, ArgReduce gives it as long int.
+    T Reduce(int op, int threads = 0) {
+        if(op == ReduceArgMin || op == ReduceArgMax) {
+            return (T)this->ArgReduce(op, threads);
+        }
+        T value;
+        Reduction::Reduce(Reduction::Lines<T>(this->Value, 1, this->Count, 0, 1), op, threads, &value, (long int*)NULL);
+        return value;
+    }
+    long int ArgReduce(int op, int threads = 0) {
+        if(op == ReduceSum || op == ReduceMean) {
+            throw Format("error in %s: %d, ArgReduce needs a min/max op", __FUNCTION__, __LINE__);
+        }
+        T value;
+        long int index;
+        Reduction::Reduce(Reduction::Lines<T>(this->Value, 1, this->Count, 0, 1), op, threads, &value, &index);
+        return index;
+    }
+    
+    ////////////////////////////////////////
+    // view
+    ////////////////////////////////////////
+    T Total(View1D<T> x) {
+        return x.Total();
+    }
+    T CalcDistance(View1D<T> a, View1D<T> b) {
+        if(CheckLevel >= 1 && a.Count != b.Count) {
+            throw Format("error in %s: %d, different View1D count %ld != %ld" , __FUNCTION__, __LINE__, a.Count, b.Count);
+        }
+        T total = 0;
+        for(long int i = 0; i < a.Count; i += 1) {
+            T d = a[i] - b[i];
+            total += d * d;
+        }
         return sqrt(total);
     }
 };
 
 template <typename T>
 void Dump1D(Num1D<T> n1d) {
-    for(int i = 0; i < n1d.Count; i += 1) {
+    for(long int i = 0; i < n1d.Count; i += 1) {
         std::cout << n1d[i];
         if(i < (n1d.Count - 1)) {
             std::cout << ", ";
@@ -439,36 +1105,230 @@ class SpotNum1D: public Num1D<T> {
     public:
     MemoryManager mm;
     SpotNum1D(): Num1D<T>(mm) {}
-    SpotNum1D(int count, T* value): Num1D<T>(mm, count, value) {}
+    SpotNum1D(long int count, T* value): Num1D<T>(mm, count, value) {}
 };
 
 
-template <typename T>
+////////////////////////////////////////
+// broadcasting
+////////////////////////////////////////
+// NumPy-style broadcasting over Num2D/Num1D/views/scalars with lazily built expressions.
+// (x - mu) * invSigma + b only records the operands; Evaluate/Assign run the whole expression
+// in a single pass over the output without temporaries.
+// A Num1D broadcasts as a row (1, Count) like in numpy, LazyCol() makes it a column (Count, 1).
+namespace Broadcast {
+    // Strided operand, a dimension of size 1 is repeated along that axis.
+    template <typename T>
+    class Leaf {
+        public:
+        typedef T Type;
+        const T* Value;
+        long int Row;
+        long int Col;
+        long int RowStride;
+        long int ColStride;
+        Leaf(const T* value, long int row, long int col, long int rowStride, long int colStride):
+            Value(value),
+            Row(row),
+            Col(col),
+            RowStride(row == 1 ? 0 : rowStride),
+            ColStride(col == 1 ? 0 : colStride) {}
+        T At(long int m, long int n) const {
+            return this->Value[m * this->RowStride + n * this->ColStride];
+        }
+    };
+    
+    template <typename T>
+    class Scalar {
+        public:
+        typedef T Type;
+        T Value;
+        long int Row;
+        long int Col;
+        Scalar(T value): Value(value), Row(1), Col(1) {}
+        T At(long int, long int) const {
+            return this->Value;
+        }
+    };
+    
+    long int BroadcastDim(long int a, long int b) {
+        if(a == b || b == 1) {
+            return a;
+        } else if(a == 1) {
+            return b;
+        }
+        throw Format("error in %s: %d, shapes cannot be broadcast %ld != %ld", __FUNCTION__, __LINE__, a, b);
+    }
+    
+    template <typename Op, typename A, typename B>
+    class Binary {
+        public:
+        typedef typename A::Type Type;
+        A a;
+        B b;
+        long int Row;
+        long int Col;
+        Binary(A x, B y): a(x), b(y), Row(BroadcastDim(x.Row, y.Row)), Col(BroadcastDim(x.Col, y.Col)) {}
+        Type At(long int m, long int n) const {
+            return Op::Apply(this->a.At(m, n), this->b.At(m, n));
+        }
+    };
+    
+    class Add {
+        public:
+        template <typename T> static T Apply(T a, T b) { return a + b; }
+    };
+    class Sub {
+        public:
+        template <typename T> static T Apply(T a, T b) { return a - b; }
+    };
+    class Mul {
+        public:
+        template <typename T> static T Apply(T a, T b) { return a * b; }
+    };
+    class Div {
+        public:
+        template <typename T> static T Apply(T a, T b) { return a / b; }
+    };
+    
+    template <typename E> class IsExpr: public std::false_type {};
+    template <typename T> class IsExpr<Leaf<T>>: public std::true_type {};
+    template <typename T> class IsExpr<Scalar<T>>: public std::true_type {};
+    template <typename Op, typename A, typename B> class IsExpr<Binary<Op, A, B>>: public std::true_type {};
+    
+    template <typename T, int Layout>
+    Leaf<T> Lazy(Num2D<T, Layout> x) {
+        return (Layout == RowMajor) ? Leaf<T>(x.Value, x.Row, x.Col, x.Col, 1) : Leaf<T>(x.Value, x.Row, x.Col, 1, x.Row);
+    }
+    template <typename T>
+    Leaf<T> Lazy(Num1D<T> x) {
+        return Leaf<T>(x.Value, 1, x.Count, 0, 1);
+    }
+    template <typename T>
+    Leaf<T> LazyCol(Num1D<T> x) {
+        return Leaf<T>(x.Value, x.Count, 1, 1, 0);
+    }
+    template <typename T>
+    Leaf<T> Lazy(View2D<T> x) {
+        return Leaf<T>(x.Value, x.Row, x.Col, x.RowStride, x.ColStride);
+    }
+    template <typename T>
+    Leaf<T> Lazy(View1D<T> x) {
+        return Leaf<T>(x.Value, 1, x.Count, 0, x.Stride);
+    }
+    template <typename T>
+    Leaf<T> LazyCol(View1D<T> x) {
+        return Leaf<T>(x.Value, x.Count, 1, x.Stride, 0);
+    }
+    template <typename E, typename std::enable_if<IsExpr<E>::value, int>::type = 0>
+    E Lazy(E e) {
+        return e;
+    }
+    
+    // Scalars take the element type of the other operand.
+    template <typename T, typename E>
+    auto Lift(E e) {
+        if constexpr (std::is_arithmetic<E>::value) {
+            return Scalar<T>((T)e);
+        } else {
+            return Lazy(e);
+        }
+    }
+    
+    template <typename A, typename B>
+    class ResultType {
+        public:
+        typedef typename std::conditional<IsExpr<A>::value, A, B>::type Expr;
+        typedef typename Expr::Type Type;
+    };
+    
+    template <typename Op, typename A, typename B>
+    auto MakeBinary(A a, B b) {
+        typedef typename ResultType<A, B>::Type T;
+        auto x = Lift<T>(a);
+        auto y = Lift<T>(b);
+        return Binary<Op, decltype(x), decltype(y)>(x, y);
+    }
+    
+    #define NUMXD_BROADCAST_OPERATOR(op, Op) \
+    template <typename A, typename B, typename std::enable_if<IsExpr<A>::value || IsExpr<B>::value, int>::type = 0> \
+    auto operator op(A a, B b) { \
+        return MakeBinary<Op>(a, b); \
+    }
+    NUMXD_BROADCAST_OPERATOR(+, Add)
+    NUMXD_BROADCAST_OPERATOR(-, Sub)
+    NUMXD_BROADCAST_OPERATOR(*, Mul)
+    NUMXD_BROADCAST_OPERATOR(/, Div)
+    #undef NUMXD_BROADCAST_OPERATOR
+    
+    template <typename T, int Layout, typename E>
+    void AssignRange(Num2D<T, Layout> dst, E expr, long int begin, long int end) {
+        if constexpr (Layout == RowMajor) {
+            for(long int m = begin; m < end; m += 1) {
+                T* d = dst.Value + m * dst.Col;
+                for(long int n = 0; n < dst.Col; n += 1) {
+                    d[n] = expr.At(m, n);
+                }
+            }
+        } else {
+            for(long int n = begin; n < end; n += 1) {
+                T* d = dst.Value + n * dst.Row;
+                for(long int m = 0; m < dst.Row; m += 1) {
+                    d[m] = expr.At(m, n);
+                }
+            }
+        }
+    }
+    
+    // Write expr into an existing buffer; dst may be one of the operands.
+    template <typename T, int Layout, typename E>
+    void Assign(Num2D<T, Layout> dst, E expr, int threads = 0) {
+        if(BroadcastDim(dst.Row, expr.Row) != dst.Row || BroadcastDim(dst.Col, expr.Col) != dst.Col) {
+            throw Format("error in %s: %d, cannot assign (%ld, %ld) to Num2D (%ld, %ld)", __FUNCTION__, __LINE__, expr.Row, expr.Col, dst.Row, dst.Col);
+        }
+        const long int outer = (Layout == RowMajor) ? dst.Row : dst.Col;
+        const long int inner = std::max(1L, (Layout == RowMajor) ? dst.Col : dst.Row);
+        Parallel::ParallelFor(0, outer, std::max(1L, Parallel::MinWork / inner), [&](long int begin, long int end) {
+            AssignRange(dst, expr, begin, end);
+        }, threads);
+    }
+    
+    // Evaluate expr into a new Num2D allocated from mm.
+    template <int Layout = RowMajor, typename E>
+    Num2D<typename E::Type, Layout> Evaluate(MemoryManager& mm, E expr, int threads = 0) {
+        Num2D<typename E::Type, Layout> n2d(mm);
+        auto dst = n2d.Create(expr.Row, expr.Col);
+        Assign(dst, expr, threads);
+        return dst;
+    }
+};
+
+template <typename T, int Layout>
 class Num2D {
     public:
-    int Row;
-    int Col;
+    long int Row;
+    long int Col;
     T* Value;
     MemoryManager& mm;
     Num2D(MemoryManager& memoryManager): Row(0), Col(0), Value(NULL), mm(memoryManager) {}
-    Num2D(MemoryManager& memoryManager, int row, int col, T* value): Row(row), Col(col), Value(value), mm(memoryManager) {}
+    Num2D(MemoryManager& memoryManager, long int row, long int col, T* value): Row(row), Col(col), Value(value), mm(memoryManager) {}
     //Num2D(Num2D x): Row(x.Row), Col(x.Col), Value(x.Value), mm(x.mm) {}
     
-    void ThrowDifferentRowCol(Num2D a, Num2D b) {
-        if(a.Row != b.Row || a.Col != b.Col) {
-            throw Format("error in %s: %d, different Num2D (%d, %d) != (%d, %d)" , __FUNCTION__, __LINE__, a.Row, a.Col, b.Row, b.Col);
+    void ThrowDifferentRowCol(const Num2D& a, const Num2D& b) {
+        if(CheckLevel >= 1 && (a.Row != b.Row || a.Col != b.Col)) {
+            throw Format("error in %s: %d, different Num2D (%ld, %ld) != (%ld, %ld)" , __FUNCTION__, __LINE__, a.Row, a.Col, b.Row, b.Col);
         }
     }
     
-    void ThrowDifferentRow(Num2D a, Num1D<T> b) {
-        if(a.Row != b.Count) {
-            throw Format("error in %s: %d, different Num2D::Row %d != %d", __FUNCTION__, __LINE__, a.Row, b.Count);
+    void ThrowDifferentRow(const Num2D& a, const Num1D<T>& b) {
+        if(CheckLevel >= 1 && a.Row != b.Count) {
+            throw Format("error in %s: %d, different Num2D::Row %ld != %ld", __FUNCTION__, __LINE__, a.Row, b.Count);
         }
     }
     
-    void ThrowDifferentCol(Num2D a, Num1D<T> b) {
-        if(a.Col != b.Count) {
-            throw Format("error in %s: %d, different Num2D::Col %d != %d", __FUNCTION__, __LINE__, a.Col, b.Count);
+    void ThrowDifferentCol(const Num2D& a, const Num1D<T>& b) {
+        if(CheckLevel >= 1 && a.Col != b.Count) {
+            throw Format("error in %s: %d, different Num2D::Col %ld != %ld", __FUNCTION__, __LINE__, a.Col, b.Count);
         }
     }
     
@@ -480,51 +1340,66 @@ class Num2D {
         return *this;
     }
     
-    T* operator[](int index) {
+    T* operator[](long int index) {
+        static_assert(Layout == RowMajor, "Num2D::operator[] returns a row, use At() or ColPtr() with ColMajor");
+        NUMXD_CHECK_INDEX(index, this->Row);
         return &this->Value[index * this->Col];
     }
     
-    Num2D operator+(Num2D r) {
-        auto answer = this->Clone(*this);
-        for(int m = 0; m < this->Row; m += 1) {
-            for(int n = 0; n < this->Col; n += 1) {
-                answer[m][n] += r[m][n];
-            }
+    T& At(long int m, long int n) {
+        NUMXD_CHECK_INDEX(m, this->Row);
+        NUMXD_CHECK_INDEX(n, this->Col);
+        if constexpr (Layout == RowMajor) {
+            return this->Value[m * this->Col + n];
+        } else {
+            return this->Value[n * this->Row + m];
         }
-        return answer;
     }
     
-    Num2D operator-(Num2D r) {
-        auto answer = this->Clone(*this);
-        for(int m = 0; m < this->Row; m += 1) {
-            for(int n = 0; n < this->Col; n += 1) {
-                answer[m][n] -= r[m][n];
+    T* ColPtr(long int index) {
+        static_assert(Layout == ColMajor, "Num2D::ColPtr needs ColMajor, use ColView() with RowMajor");
+        NUMXD_CHECK_INDEX(index, this->Col);
+        return &this->Value[index * this->Row];
+    }
+    
+    // Elementwise operations walk the flat buffer, both operands share the layout.
+    // answer[i] = f(this[i], i), split over the thread pool above Parallel::MinWork elements.
+    template <typename F>
+    Num2D Elementwise(F f) {
+        auto answer = this->Create(this->Row, this->Col);
+        const T* a = this->Value;
+        T* d = answer.Value;
+        Parallel::ParallelFor(0, this->Row * this->Col, Parallel::MinWork, [&](long int begin, long int end) {
+            for(long int i = begin; i < end; i += 1) {
+                d[i] = f(a[i], i);
             }
-        }
+        });
         return answer;
     }
     
+    Num2D operator+(Num2D r) {
+        ThrowDifferentRowCol(*this, r);
+        const T* b = r.Value;
+        return this->Elementwise([=](T a, long int i) { return a + b[i]; });
+    }
+    
+    Num2D operator-(Num2D r) {
+        ThrowDifferentRowCol(*this, r);
+        const T* b = r.Value;
+        return this->Elementwise([=](T a, long int i) { return a - b[i]; });
+    }
+    
     Num2D operator/(Num2D r) {
-        auto answer = this->Clone(*this);
-        for(int m = 0; m < this->Row; m += 1) {
-            for(int n = 0; n < this->Col; n += 1) {
-                answer[m][n] /= r[m][n];
-            }
-        }
-        return answer;
+        ThrowDifferentRowCol(*this, r);
+        const T* b = r.Value;
+        return this->Elementwise([=](T a, long int i) { return a / b[i]; });
     }
     
     Num2D operator/(T r) {
-        auto answer = this->Clone(*this);
-        for(int m = 0; m < this->Row; m += 1) {
-            for(int n = 0; n < this->Col; n += 1) {
-                answer[m][n] /= r;
-            }
-        }
-        return answer;
+        return this->Elementwise([=](T a, long int) { return a / r; });
     }
     
-    Num2D Create(int row, int col) {
+    Num2D Create(long int row, long int col) {
         Num2D dst(this->mm, row, col, (T*)this->mm.Alloc(sizeof(T) * row * col));
         return dst;
     }
@@ -533,7 +1408,7 @@ class Num2D {
     }
 
     Num2D Clone(MemoryManager& mm, Num2D src) {
-        Num2D<T> n2d(mm);
+        Num2D n2d(mm);
         return n2d.Clone(src);
     }
     Num2D Clone(Num2D src) {
@@ -555,67 +1430,140 @@ class Num2D {
         return dst;
     }
     Num2D Transpose() {
-        auto dst = Create(this->Col, this->Row);
-        for(int m = 0; m < dst.Row; m += 1) {
-            for(int n = 0; n < dst.Col; n += 1) {
-                dst[m][n] += (*this)[n][m];
-            }
-        }
-        return dst;
+        return this->Transpose(*this);
     }
     Num2D Transpose(Num2D src) {
         auto dst = Create(src.Col, src.Row);
-        for(int m = 0; m < dst.Row; m += 1) {
-            for(int n = 0; n < dst.Col; n += 1) {
-                dst[m][n] += src[n][m];
+        Parallel::ParallelFor(0, dst.Row, std::max(1L, Parallel::MinWork / std::max(1L, dst.Col)), [&](long int begin, long int end) {
+            for(long int m = begin; m < end; m += 1) {
+                for(long int n = 0; n < dst.Col; n += 1) {
+                    dst.At(m, n) = src.At(n, m);
+                }
+            }
+        });
+        return dst;
+    }
+    
+    ////////////////////////////////////////
+    // layout
+    ////////////////////////////////////////
+    // Copying conversion between the two storage orders, the shape is unchanged.
+    Num2D<T, 1 - Layout> ToLayout() {
+        Num2D<T, 1 - Layout> n2d(this->mm);
+        auto dst = n2d.Create(this->Row, this->Col);
+        for(long int m = 0; m < this->Row; m += 1) {
+            for(long int n = 0; n < this->Col; n += 1) {
+                dst.At(m, n) = this->At(m, n);
             }
         }
         return dst;
     }
+    Num2D<T, ColMajor> ToColMajor() {
+        static_assert(Layout == RowMajor, "Num2D is already ColMajor");
+        return this->ToLayout();
+    }
+    Num2D<T, RowMajor> ToRowMajor() {
+        static_assert(Layout == ColMajor, "Num2D is already RowMajor");
+        return this->ToLayout();
+    }
+    // Zero-cost: the same memory read in the other order is the transpose.
+    Num2D<T, 1 - Layout> TransposeView() {
+        return Num2D<T, 1 - Layout>(this->mm, this->Col, this->Row, this->Value);
+    }
     
     
     ////////////////////////////////////////
     // reference
     ////////////////////////////////////////
-    Num1D<T> Ref(int index) {
+    Num1D<T> Ref(long int index) {
         Num1D<T> ref(this->mm, this->Col, (*this)[index]);
         return ref;
     }
-    Num1D<T> Ref(Num2D src, int index) {
+    Num1D<T> Ref(Num2D src, long int index) {
         Num1D<T> ref(this->mm, src.Col, src[index]);
         return ref;
     }
-    Num1D<T> Val(Num2D src, int index) {
+    Num1D<T> Val(Num2D src, long int index) {
         Num1D<T> n1d(this->mm);
         auto dst = n1d.Create(src.Col);
         memcpy(dst.Value, src[index], sizeof(T) * src.Col);
         return dst;
     }
-    Num1D<T> ValT(Num2D src, int index) {
+    Num1D<T> ValT(Num2D src, long int index) {
         Num1D<T> n1d(this->mm);
         auto dst = n1d.Create(src.Row);
-        for(int i = 0; i < dst.Count; i++) {
-            dst[i] = src[i][index];
+        if constexpr (Layout == ColMajor) {
+            memcpy(dst.Value, src.ColPtr(index), sizeof(T) * src.Row);
+        } else {
+            for(long int i = 0; i < dst.Count; i++) {
+                dst[i] = src[i][index];
+            }
         }
         return dst;
     }
+    
+    ////////////////////////////////////////
+    // view
+    ////////////////////////////////////////
+    View2D<T> View() {
+        return View2D<T>(*this);
+    }
+    View1D<T> RowView(long int index) {
+        return this->View().Ref(index);
+    }
+    View1D<T> ColView(long int index) {
+        return this->View().ColRef(index);
+    }
+    View2D<T> Block(long int rowStart, long int rowEnd, long int colStart, long int colEnd) {
+        return this->View().Block(rowStart, rowEnd, colStart, colEnd);
+    }
+    IndexView2D<T> IndexView(Num1D<long int> indexes) {
+        return IndexView2D<T>(this->View(), indexes.Count, indexes.Value);
+    }
 
     ////////////////////////////////////////
     // index operation
     ////////////////////////////////////////
-    Num2D Indexing(Num2D src, Num1D<int> indexes) {
+    Num2D Indexing(Num2D src, Num1D<long int> indexes) {
         auto dst = Create(indexes.Count, src.Col);
-        for(int i = 0; i < indexes.Count; i+= 1) {
-            memcpy(dst[i], src[indexes[i]], sizeof(T) * src.Col);
+        if constexpr (Layout == ColMajor) {
+            Parallel::ParallelFor(0, src.Col, std::max(1L, Parallel::MinWork / std::max(1L, indexes.Count)), [&](long int begin, long int end) {
+                for(long int n = begin; n < end; n += 1) {
+                    T* s = src.ColPtr(n);
+                    T* d = dst.ColPtr(n);
+                    for(long int i = 0; i < indexes.Count; i += 1) {
+                        d[i] = s[indexes[i]];
+                    }
+                }
+            });
+        } else {
+            Parallel::ParallelFor(0, indexes.Count, std::max(1L, Parallel::MinWork / std::max(1L, src.Col)), [&](long int begin, long int end) {
+                for(long int i = begin; i < end; i += 1) {
+                    memcpy(dst[i], src[indexes[i]], sizeof(T) * src.Col);
+                }
+            });
         }
         return dst;
     }
-    Num2D IndexingT(Num2D src, Num1D<int> indexes) {
-        auto srcT = Transpose(src);
-        auto indexed = Indexing(srcT, indexes);
-        auto dst = Transpose(indexed);
-        srcT.Release();
-        indexed.Release();
+    Num2D IndexingT(Num2D src, Num1D<long int> indexes) {
+        auto dst = Create(src.Row, indexes.Count);
+        if constexpr (Layout == ColMajor) {
+            Parallel::ParallelFor(0, indexes.Count, std::max(1L, Parallel::MinWork / std::max(1L, src.Row)), [&](long int begin, long int end) {
+                for(long int i = begin; i < end; i += 1) {
+                    memcpy(dst.ColPtr(i), src.ColPtr(indexes[i]), sizeof(T) * src.Row);
+                }
+            });
+        } else {
+            Parallel::ParallelFor(0, src.Row, std::max(1L, Parallel::MinWork / std::max(1L, indexes.Count)), [&](long int begin, long int end) {
+                for(long int m = begin; m < end; m += 1) {
+                    T* s = src[m];
+                    T* d = dst[m];
+                    for(long int i = 0; i < indexes.Count; i += 1) {
+                        d[i] = s[indexes[i]];
+                    }
+                }
+            });
+        }
         return dst;
     }
     
@@ -627,95 +1575,90 @@ class Num2D {
     
     
     // Subtract
-    Num2D<T> Subtract(Num1D<T> r) {
+    Num2D Subtract(Num1D<T> r) {
         ThrowDifferentCol(*this, r);
-        auto answer = this->Create(this->Row, this->Col);
-        for(int m = 0; m < this->Row; m += 1) {
-            for(int n = 0; n < this->Col; n += 1) {
-                answer[m][n] = (*this)[m][n] - r[n];
-            }
-        }
-        return answer;
+        return Broadcast::Evaluate<Layout>(this->mm, Broadcast::Lazy(*this) - r);
     }
     
-    Num1D<T> SubtractT(Num1D<T> r) {
+    Num2D SubtractT(Num1D<T> r) {
         ThrowDifferentRow(*this, r);
-        auto answer = this->Create(this->Row, this->Col);
-        for(int m = 0; m < this->Row; m += 1) {
-            for(int n = 0; n < this->Col; n += 1) {
-                answer[m][n] = (*this)[m][n] - r[m];
-            }
-        }
-        return answer;
+        return Broadcast::Evaluate<Layout>(this->mm, Broadcast::Lazy(*this) - Broadcast::LazyCol(r));
     }
     
-    Num1D<T> SubtractX(T n) {
-        auto answer = this->Create(this->Row, this->Col);
-        for(int m = 0; m < this->Row; m += 1) {
-            for(int n = 0; n < this->Col; n += 1) {
-                answer[m][n] = (*this)[m][n] - n;
-            }
-        }
-        return answer;
+    Num2D SubtractX(T x) {
+        return Broadcast::Evaluate<Layout>(this->mm, Broadcast::Lazy(*this) - x);
     }
     
     
     
     // Division
-     Num2D<T> Division(Num1D<T> r, double safeValue = 0) {
+    Num2D Division(Num1D<T> r, double safeValue = 0) {
         ThrowDifferentCol(*this, r);
-        auto answer = this->Create(this->Row, this->Col);
-        for(int m = 0; m < this->Row; m += 1) {
-            for(int n = 0; n < this->Col; n += 1) {
-                answer[m][n] = (*this)[m][n] / (r[n] + safeValue);
-            }
-        }
-        return answer;
+        return Broadcast::Evaluate<Layout>(this->mm, Broadcast::Lazy(*this) / (Broadcast::Lazy(r) + safeValue));
     }
     
     
     
     
     Num2D Power(double b) {
-        auto dst = this->Clone();
-        for(int m = 0; m < this->Row; m += 1) {
-            for(int n = 0; n < this->Col; n += 1) {
-                dst[m][n] += (T)powf((double)dst[m][n], b);
-            }
-        }
-        return dst;
+        return this->Elementwise([=](T a, long int) { return (T)powf((double)a, b); });
     }
     
     
     
-    // Total
-    Num1D<T> Total() {
+    ////////////////////////////////////////
+    // Reduction
+    ////////////////////////////////////////
+    // axis 0 reduces over rows (one value per column), axis 1 over columns (one value per row), -1 over everything.
+    Reduction::Lines<T> ReduceLines(int axis) {
+        const long int row = this->Row;
+        const long int col = this->Col;
+        if(axis < 0) {
+            return Reduction::Lines<T>(this->Value, 1, row * col, 0, 1);
+        } else if(axis == 0) {
+            return (Layout == RowMajor) ? Reduction::Lines<T>(this->Value, col, row, 1, col) : Reduction::Lines<T>(this->Value, col, row, row, 1);
+        } else {
+            return (Layout == RowMajor) ? Reduction::Lines<T>(this->Value, row, col, col, 1) : Reduction::Lines<T>(this->Value, row, col, 1, row);
+        }
+    }
+    // ReduceArgMin/ReduceArgMax give the indexes converted to T, ArgReduce gives them as long int.
+    Num1D<T> Reduce(int axis, int op, int threads = 0) {
+        auto lines = this->ReduceLines(axis);
         Num1D<T> n1d(this->mm);
-        auto answer = n1d.Zeros(this->Col);
-        for(int m = 0; m < this->Row; m += 1) {
-            for(int n = 0; n < this->Col; n += 1) {
-                answer[n] += (*this)[m][n];
+        auto answer = n1d.Create(lines.Count);
+        if(op == ReduceArgMin || op == ReduceArgMax) {
+            auto indexes = this->ArgReduce(axis, op, threads);
+            for(long int i = 0; i < answer.Count; i += 1) {
+                answer[i] = (T)indexes[i];
             }
+            indexes.Release();
+        } else {
+            Reduction::Reduce(lines, op, threads, answer.Value, (long int*)NULL);
         }
         return answer;
     }
-    Num1D<T> TotalT() {
-        Num1D<T> n1d(this->mm);
-        auto answer = n1d.Zeros(this->Row);
-        for(int m = 0; m < this->Row; m += 1) {
-            for(int n = 0; n < this->Col; n += 1) {
-                answer[m] += (*this)[m][n];
-            }
+    Num1D<long int> ArgReduce(int axis, int op, int threads = 0) {
+        if(op == ReduceSum || op == ReduceMean) {
+            throw Format("error in %s: %d, ArgReduce needs a min/max op", __FUNCTION__, __LINE__);
         }
+        auto lines = this->ReduceLines(axis);
+        std::vector<T> values(lines.Count);
+        Num1D<long int> n1d(this->mm);
+        auto answer = n1d.Create(lines.Count);
+        Reduction::Reduce(lines, op, threads, values.data(), answer.Value);
         return answer;
     }
+    
+    // Total
+    Num1D<T> Total() {
+        return this->Reduce(0, ReduceSum);
+    }
+    Num1D<T> TotalT() {
+        return this->Reduce(1, ReduceSum);
+    }
     T TotalX() {
-        T answer = 0;
-        for(int m = 0; m < this->Row; m += 1) {
-            for(int n = 0; n < this->Col; n += 1) {
-                answer += (*this)[m][n];
-            }
-        }
+        T answer;
+        Reduction::Reduce(this->ReduceLines(-1), ReduceSum, 0, &answer, (long int*)NULL);
         return answer;
     }
     
@@ -723,20 +1666,10 @@ class Num2D {
     
     // Mean
     Num1D<T> Mean() {
-        Num1D<T> n1d(this->mm);
-        auto total = this->Total();
-        auto answer = total / this->Row;
-        total.Release();
-        return answer;
+        return this->Reduce(0, ReduceMean);
     }
     Num1D<T> MeanT() {
-        Num1D<T> n1d(this->mm);
-        auto total = this->TotalT();
-        auto answer = total / this->Col;
-        
-        total.Release();
-        
-        return answer;
+        return this->Reduce(1, ReduceMean);
     }
     
     // Variance
@@ -792,11 +1725,11 @@ class Num2D {
     }
 };
 
-template <typename T>
-void Dump2D(Num2D<T> x) {
-    for(int m = 0; m < x.Row; m += 1) {
-        for(int n = 0; n < x.Col; n += 1) {
-            std::cout << x[m][n];
+template <typename T, int Layout>
+void Dump2D(Num2D<T, Layout> x) {
+    for(long int m = 0; m < x.Row; m += 1) {
+        for(long int n = 0; n < x.Col; n += 1) {
+            std::cout << x.At(m, n);
             if(n < (x.Col - 1)) {
                 std::cout << ", ";
             }
@@ -805,12 +1738,213 @@ void Dump2D(Num2D<T> x) {
     }
 }
 
-template <typename T>
-class SpotNum2D: public Num2D<T> {
+template <typename T, int Layout = RowMajor>
+class SpotNum2D: public Num2D<T, Layout> {
     public:
     MemoryManager mm;
-    SpotNum2D(): Num2D<T>(mm) {}
-    SpotNum2D(int row, int col, T* value): Num2D<T>(mm, row, col, value) {}
+    SpotNum2D(): Num2D<T, Layout>(mm) {}
+    SpotNum2D(long int row, long int col, T* value): Num2D<T, Layout>(mm, row, col, value) {}
+};
+
+////////////////////////////////////////
+// view
+////////////////////////////////////////
+// Non-owning views over the memory of a Num1D/Num2D, nothing is copied until Val() is called.
+// A view is valid only as long as the memory it points to.
+template <typename T>
+class View1D {
+    public:
+    long int Count;
+    long int Stride;
+    T* Value;
+    MemoryManager& mm;
+    View1D(MemoryManager& memoryManager, long int count, long int stride, T* value): Count(count), Stride(stride), Value(value), mm(memoryManager) {}
+    View1D(Num1D<T> x): Count(x.Count), Stride(1), Value(x.Value), mm(x.mm) {}
+    
+    T& operator[](long int index) {
+        NUMXD_CHECK_INDEX(index, this->Count);
+        return this->Value[index * this->Stride];
+    }
+    
+    Num1D<T> Val() {
+        Num1D<T> n1d(this->mm);
+        auto dst = n1d.Create(this->Count);
+        for(long int i = 0; i < this->Count; i += 1) {
+            dst[i] = (*this)[i];
+        }
+        return dst;
+    }
+    
+    T Total() {
+        T total;
+        Reduction::Reduce(Reduction::Lines<T>(this->Value, 1, this->Count, 0, this->Stride), ReduceSum, 0, &total, (long int*)NULL);
+        return total;
+    }
+    T Mean() {
+        return this->Total() / this->Count;
+    }
+    
+    Num1D<T> Subtract(View1D<T> b) {
+        if(CheckLevel >= 1 && this->Count != b.Count) {
+            throw Format("error in %s: %d, different View1D count %ld != %ld" , __FUNCTION__, __LINE__, this->Count, b.Count);
+        }
+        auto dst = this->Val();
+        for(long int i = 0; i < this->Count; i += 1) {
+            dst[i] -= b[i];
+        }
+        return dst;
+    }
+};
+
+template <typename T>
+class View2D {
+    public:
+    long int Row;
+    long int Col;
+    long int RowStride;
+    long int ColStride;
+    T* Value;
+    MemoryManager& mm;
+    View2D(MemoryManager& memoryManager, long int row, long int col, long int rowStride, long int colStride, T* value):
+        Row(row), Col(col), RowStride(rowStride), ColStride(colStride), Value(value), mm(memoryManager) {}
+    template <int Layout>
+    View2D(Num2D<T, Layout> x):
+        Row(x.Row),
+        Col(x.Col),
+        RowStride(Layout == RowMajor ? x.Col : 1),
+        ColStride(Layout == RowMajor ? 1 : x.Row),
+        Value(x.Value),
+        mm(x.mm) {}
+    
+    T& operator()(long int m, long int n) {
+        NUMXD_CHECK_INDEX(m, this->Row);
+        NUMXD_CHECK_INDEX(n, this->Col);
+        return this->Value[m * this->RowStride + n * this->ColStride];
+    }
+    View1D<T> Ref(long int index) {
+        NUMXD_CHECK_INDEX(index, this->Row);
+        return View1D<T>(this->mm, this->Col, this->ColStride, this->Value + index * this->RowStride);
+    }
+    View1D<T> ColRef(long int index) {
+        NUMXD_CHECK_INDEX(index, this->Col);
+        return View1D<T>(this->mm, this->Row, this->RowStride, this->Value + index * this->ColStride);
+    }
+    View2D<T> Block(long int rowStart, long int rowEnd, long int colStart, long int colEnd) {
+        NUMXD_CHECK_RANGE(rowStart, rowEnd, this->Row);
+        NUMXD_CHECK_RANGE(colStart, colEnd, this->Col);
+        T* start = this->Value + rowStart * this->RowStride + colStart * this->ColStride;
+        return View2D<T>(this->mm, rowEnd - rowStart, colEnd - colStart, this->RowStride, this->ColStride, start);
+    }
+    View2D<T> Transpose() {
+        return View2D<T>(this->mm, this->Col, this->Row, this->ColStride, this->RowStride, this->Value);
+    }
+    
+    Num2D<T> Val() {
+        Num2D<T> n2d(this->mm);
+        auto dst = n2d.Create(this->Row, this->Col);
+        for(long int m = 0; m < this->Row; m += 1) {
+            for(long int n = 0; n < this->Col; n += 1) {
+                dst[m][n] = (*this)(m, n);
+            }
+        }
+        return dst;
+    }
+    
+    Num1D<T> Total() {
+        Num1D<T> n1d(this->mm);
+        auto answer = n1d.Create(this->Col);
+        Reduction::Lines<T> lines(this->Value, this->Col, this->Row, this->ColStride, this->RowStride);
+        Reduction::Reduce(lines, ReduceSum, 0, answer.Value, (long int*)NULL);
+        return answer;
+    }
+    T TotalX() {
+        auto total = this->Total();
+        T answer = total.Reduce(ReduceSum);
+        total.Release();
+        return answer;
+    }
+    Num1D<T> Mean() {
+        auto total = this->Total();
+        auto answer = total / this->Row;
+        total.Release();
+        return answer;
+    }
+    
+    Num2D<T> Subtract(View1D<T> r) {
+        if(CheckLevel >= 1 && this->Col != r.Count) {
+            throw Format("error in %s: %d, different View2D::Col %ld != %ld", __FUNCTION__, __LINE__, this->Col, r.Count);
+        }
+        Num2D<T> n2d(this->mm);
+        auto answer = n2d.Create(this->Row, this->Col);
+        for(long int m = 0; m < this->Row; m += 1) {
+            for(long int n = 0; n < this->Col; n += 1) {
+                answer[m][n] = (*this)(m, n) - r[n];
+            }
+        }
+        return answer;
+    }
+};
+
+// Rows of src selected by indexes, gathered lazily.
+template <typename T>
+class IndexView2D {
+    public:
+    View2D<T> Src;
+    long int Row;
+    long int Col;
+    const long int* Index;
+    MemoryManager& mm;
+    IndexView2D(View2D<T> src, long int count, const long int* index): Src(src), Row(count), Col(src.Col), Index(index), mm(src.mm) {}
+    
+    T& operator()(long int m, long int n) {
+        NUMXD_CHECK_INDEX(m, this->Row);
+        return this->Src(this->Index[m], n);
+    }
+    View1D<T> Ref(long int index) {
+        NUMXD_CHECK_INDEX(index, this->Row);
+        return this->Src.Ref(this->Index[index]);
+    }
+    
+    Num2D<T> Val() {
+        Num2D<T> n2d(this->mm);
+        auto dst = n2d.Create(this->Row, this->Col);
+        for(long int m = 0; m < this->Row; m += 1) {
+            for(long int n = 0; n < this->Col; n += 1) {
+                dst[m][n] = (*this)(m, n);
+            }
+        }
+        return dst;
+    }
+    
+    // The rows are gathered Reduction::Block at a time into a dense buffer the engine reduces, and the block
+    // totals are combined with KahanAdd, as the engine combines its own blocks.
+    Num1D<T> Total() {
+        Num1D<T> n1d(this->mm);
+        auto answer = n1d.Zeros(this->Col);
+        std::vector<T> buffer(Reduction::Block * this->Col);
+        std::vector<T> part(this->Col);
+        std::vector<T> comp(this->Col, 0);
+        for(long int m0 = 0; m0 < this->Row; m0 += Reduction::Block) {
+            const long int rows = std::min(Reduction::Block, this->Row - m0);
+            for(long int m = 0; m < rows; m += 1) {
+                auto row = this->Ref(m0 + m);
+                for(long int n = 0; n < this->Col; n += 1) {
+                    buffer[m * this->Col + n] = row[n];
+                }
+            }
+            Reduction::Reduce(Reduction::Lines<T>(buffer.data(), this->Col, rows, 1, this->Col), ReduceSum, 0, part.data(), (long int*)NULL);
+            for(long int n = 0; n < this->Col; n += 1) {
+                Reduction::KahanAdd(answer[n], comp[n], part[n]);
+            }
+        }
+        return answer;
+    }
+    Num1D<T> Mean() {
+        auto total = this->Total();
+        auto answer = total / this->Row;
+        total.Release();
+        return answer;
+    }
 };
 
 std::vector<std::string> string_token(std::string x, std::vector<char> tokens) {
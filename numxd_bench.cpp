@@ -0,0 +1,335 @@
+#include <chrono>
+#include <functional>
+
+#include "distance.h"
+#include "kmeans.h"
+#include "numxd.h"
+#include "preprocessing.h"
+#include "quantize.h"
+#include "tsv.h"
+
+// Benchmarks for the numxd kernels on synthetic Gaussian blobs.
+// Every case is run warmup times untimed, then repeat times timed; the result is printed as JSON on stdout.
+//   ./numxd_bench --rows 1000000 --cols 8 --clusters 16 --repeat 10 --filter kmeans > run.json
+
+class BenchConfig {
+    public:
+    long int Rows;
+    int Cols;
+    int Clusters;
+    int Repeat;
+    int Warmup;
+    int Iterations;
+    unsigned int Seed;
+    std::string Filter;
+    std::string TempDir;
+    BenchConfig(): Rows(100000), Cols(8), Clusters(8), Repeat(10), Warmup(2), Iterations(10), Seed(1), TempDir("/tmp") {}
+};
+
+class BenchResult {
+    public:
+    std::string Name;
+    std::vector<double> Seconds;
+    double Bytes;
+    double Rows;
+};
+
+// rows x cols points around clusters centers drawn uniformly from [-10, 10), each with unit variance times spread.
+// labels (unless NULL) receives the generating center of every row.
+Num2D<double> GaussianBlobs(MemoryManager& mm, long int rows, int cols, int clusters, double spread, unsigned int seed, Num1D<Label>* labels) {
+    std::mt19937 mt(seed);
+    std::uniform_real_distribution<double> uniform(-10, 10);
+    std::normal_distribution<double> normal(0, spread);
+    std::uniform_int_distribution<int> pick(0, clusters - 1);
+
+    std::vector<double> centers((size_t)clusters * cols);
+    for(auto center = centers.begin(); center != centers.end(); center++) {
+        *center = uniform(mt);
+    }
+    Num2D<double> n2d(mm);
+    auto x = n2d.Create(rows, cols);
+    for(long int m = 0; m < rows; m += 1) {
+        int cluster = pick(mt);
+        for(int n = 0; n < cols; n += 1) {
+            x[m][n] = centers[(size_t)cluster * cols + n] + normal(mt);
+        }
+        if(labels != NULL) {
+            (*labels)[m] = cluster;
+        }
+    }
+    return x;
+}
+
+double Percentile(std::vector<double> sorted, double p) {
+    double position = p * (sorted.size() - 1);
+    size_t lower = (size_t)position;
+    size_t upper = std::min(lower + 1, sorted.size() - 1);
+    return sorted[lower] + (sorted[upper] - sorted[lower]) * (position - lower);
+}
+
+class Bench {
+    public:
+    BenchConfig Config;
+    std::vector<BenchResult> Results;
+    Bench(BenchConfig config): Config(config) {}
+
+    // bytes and rows are the amount of data one call of f touches, for the throughput columns.
+    void Run(const char* name, double bytes, double rows, std::function<void()> f) {
+        if(this->Config.Filter.size() > 0 && std::string(name).find(this->Config.Filter) == std::string::npos) {
+            return;
+        }
+        for(int i = 0; i < this->Config.Warmup; i += 1) {
+            f();
+        }
+        BenchResult result;
+        result.Name = name;
+        result.Bytes = bytes;
+        result.Rows = rows;
+        for(int i = 0; i < this->Config.Repeat; i += 1) {
+            auto start = std::chrono::steady_clock::now();
+            f();
+            auto end = std::chrono::steady_clock::now();
+            result.Seconds.push_back(std::chrono::duration<double>(end - start).count());
+        }
+        this->Results.push_back(result);
+    }
+
+    void Json(std::ostream& os) {
+        os << std::setprecision(6);
+        os << "{\n";
+        os << "  \"config\": {\"rows\": " << this->Config.Rows << ", \"cols\": " << this->Config.Cols;
+        os << ", \"clusters\": " << this->Config.Clusters << ", \"repeat\": " << this->Config.Repeat;
+        os << ", \"warmup\": " << this->Config.Warmup << ", \"seed\": " << this->Config.Seed << "},\n";
+        os << "  \"results\": [\n";
+        for(auto result = this->Results.begin(); result != this->Results.end(); result++) {
+            auto sorted = result->Seconds;
+            std::sort(sorted.begin(), sorted.end());
+            double total = 0;
+            for(auto s = sorted.begin(); s != sorted.end(); s++) {
+                total += *s;
+            }
+            double p50 = Percentile(sorted, 0.5);
+            os << "    {\"name\": \"" << result->Name << "\"";
+            os << ", \"min_ms\": " << sorted.front() * 1e3;
+            os << ", \"mean_ms\": " << total / sorted.size() * 1e3;
+            os << ", \"p50_ms\": " << p50 * 1e3;
+            os << ", \"p90_ms\": " << Percentile(sorted, 0.9) * 1e3;
+            os << ", \"p99_ms\": " << Percentile(sorted, 0.99) * 1e3;
+            os << ", \"max_ms\": " << sorted.back() * 1e3;
+            os << ", \"gb_per_s\": " << result->Bytes / p50 / 1e9;
+            os << ", \"rows_per_s\": " << result->Rows / p50;
+            os << "}" << (result + 1 != this->Results.end() ? "," : "") << "\n";
+        }
+        os << "  ]\n";
+        os << "}\n";
+    }
+};
+
+void BenchMemoryManager(Bench& bench) {
+    const int cycles = 10000;
+    bench.Run("memory_manager_alloc_release", 0, cycles, [&]() {
+        MemoryManager mm;
+        void* p[4];
+        for(int i = 0; i < cycles; i += 1) {
+            for(int k = 0; k < 4; k += 1) {
+                p[k] = mm.Alloc(64 << (k * 4));
+            }
+            for(int k = 0; k < 4; k += 1) {
+                mm.Release(p[k]);
+            }
+        }
+    });
+}
+
+void BenchKernels(Bench& bench, Num2D<double> x) {
+    MemoryManager& mm = x.mm;
+    const double bytes = sizeof(double) * (double)x.Row * x.Col;
+    auto mean = x.Mean();
+    auto stdDev = x.StdDev();
+    Num1D<long int> n1d(mm);
+    auto columns = n1d.Arange(0, x.Col / 2 + 1);
+
+    bench.Run("elementwise_add", bytes * 3, x.Row, [&]() {
+        auto y = x + x;
+        y.Release();
+    });
+    bench.Run("broadcast_standardize", bytes * 2, x.Row, [&]() {
+        auto y = Broadcast::Evaluate(mm, (Broadcast::Lazy(x) - mean) / stdDev);
+        y.Release();
+    });
+    bench.Run("reduce_total", bytes, x.Row, [&]() {
+        auto y = x.Total();
+        y.Release();
+    });
+    bench.Run("reduce_total_t", bytes, x.Row, [&]() {
+        auto y = x.TotalT();
+        y.Release();
+    });
+    bench.Run("reduce_argmin", bytes, x.Row, [&]() {
+        auto y = x.ArgReduce(1, ReduceArgMin);
+        y.Release();
+    });
+    bench.Run("variance", bytes * 4, x.Row, [&]() {
+        auto y = x.Variance();
+        y.Release();
+    });
+    bench.Run("transpose", bytes * 2, x.Row, [&]() {
+        auto y = x.Transpose();
+        y.Release();
+    });
+    bench.Run("indexing_t", bytes * 2, x.Row, [&]() {
+        auto y = x.IndexingT(x, columns);
+        y.Release();
+    });
+
+    auto sample = x.Block(0, std::min(x.Row, 2048L), 0, x.Col).Val();
+    Num2D<double> n2d(mm);
+    auto distances = n2d.Create(sample.Row, sample.Row);
+    const double pairs = (double)sample.Row * sample.Row;
+    bench.Run("cdist_euclidean", sizeof(double) * pairs, pairs, [&]() {
+        Distance::CDist(sample, sample, MetricEuclidean, distances);
+    });
+    bench.Run("cdist_cosine", sizeof(double) * pairs, pairs, [&]() {
+        Distance::CDist(sample, sample, MetricCosine, distances);
+    });
+    
+    mean.Release();
+    stdDev.Release();
+    columns.Release();
+    sample.Release();
+    distances.Release();
+}
+
+void BenchTSV(Bench& bench, Num2D<double> x) {
+    std::string path = bench.Config.TempDir + "/numxd_bench.tsv";
+    TSV::Write(path.c_str(), x);
+    struct stat st;
+    stat(path.c_str(), &st);
+    const double bytes = st.st_size;
+
+    bench.Run("tsv_write", bytes, x.Row, [&]() {
+        TSV::Write(path.c_str(), x);
+    });
+    bench.Run("tsv_read", bytes, x.Row, [&]() {
+        MemoryManager mm;
+        TSV::ToDouble(mm, TSV::Read(path.c_str()));
+    });
+    bench.Run("tsv_read_parallel", bytes, x.Row, [&]() {
+        MemoryManager mm;
+        TSV::ReadParallel(mm, path.c_str());
+    });
+    unlink(path.c_str());
+}
+
+void BenchModels(Bench& bench, Num2D<double> x) {
+    const double bytes = sizeof(double) * (double)x.Row * x.Col;
+    const int iterations = bench.Config.Iterations;
+
+    bench.Run("standard_scaler", bytes * 6, x.Row, [&]() {
+        MemoryManager mm;
+        StandardScaler scaler(x);
+        scaler.Fit();
+        scaler.Transform(mm);
+    });
+    bench.Run("kmeans_training", bytes * iterations * 2, (double)x.Row * iterations, [&]() {
+        KMeans km(bench.Config.Clusters);
+        km.Initialize(x, KMeans::enumInitializeRandom);
+        km.Training(x, iterations, 0);
+    });
+    // the same training over 2 and 1 byte codes alone, without the exact rows to rescore ties against
+    const char* names[3] = {"kmeans_training_fp16", "kmeans_training_bf16", "kmeans_training_int8"};
+    const int formats[3] = {QuantFloat16, QuantBFloat16, QuantInt8};
+    for(int f = 0; f < 3; f += 1) {
+        MemoryManager mm;
+        Quantized2D q2d(mm);
+        auto quantized = q2d.FromDense(x, formats[f]);
+        bench.Run(names[f], (double)quantized.Bytes() * iterations * 2, (double)x.Row * iterations, [&]() {
+            KMeans km(bench.Config.Clusters);
+            km.Initialize(x, KMeans::enumInitializeRandom);
+            km.Training(quantized, iterations, 0);
+        });
+    }
+    
+    KMeans km(bench.Config.Clusters);
+    km.Initialize(x, KMeans::enumInitializeRandom);
+    km.Training(x, iterations, 0);
+    const long int samples = std::min(x.Row, 10000L);
+    bench.Run("kmeans_predict_single", sizeof(double) * (double)samples * x.Col, samples, [&]() {
+        double distance;
+        for(long int m = 0; m < samples; m += 1) {
+            km.Predict(x[m], x.Col, &distance);
+        }
+    });
+    
+    // vector quantization sized codebook, scanned and through the centroid index
+    const int codebook = 4096;
+    if(x.Row >= codebook) {
+        KMeans vq(codebook);
+        vq.Initialize(x, KMeans::enumInitializeRandom);
+        vq.Training(x, 1, 0);
+        bench.Run("kmeans_predict_4096_scan", sizeof(double) * (double)samples * x.Col, samples, [&]() {
+            double distance;
+            for(long int m = 0; m < samples; m += 1) {
+                vq.Predict(x[m], x.Col, &distance);
+            }
+        });
+        vq.BuildIndex();
+        bench.Run("kmeans_predict_4096_index", sizeof(double) * (double)samples * x.Col, samples, [&]() {
+            double distance;
+            for(long int m = 0; m < samples; m += 1) {
+                vq.Predict(x[m], x.Col, &distance);
+            }
+        });
+    }
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    for(int i = 1; i + 1 < argc; i += 2) {
+        std::string key = argv[i];
+        const char* value = argv[i + 1];
+        if(key == "--rows") {
+            config.Rows = atol(value);
+        } else if(key == "--cols") {
+            config.Cols = atoi(value);
+        } else if(key == "--clusters") {
+            config.Clusters = atoi(value);
+        } else if(key == "--repeat") {
+            config.Repeat = atoi(value);
+        } else if(key == "--warmup") {
+            config.Warmup = atoi(value);
+        } else if(key == "--iterations") {
+            config.Iterations = atoi(value);
+        } else if(key == "--seed") {
+            config.Seed = atoi(value);
+        } else if(key == "--filter") {
+            config.Filter = value;
+        } else if(key == "--tmp") {
+            config.TempDir = value;
+        } else {
+            std::cerr << "unknown option " << key << std::endl;
+            return 1;
+        }
+    }
+    // the JSON percentiles need at least one timed run
+    if(config.Rows < 1 || config.Cols < 1 || config.Clusters < 1 || config.Repeat < 1) {
+        std::cerr << "--rows, --cols, --clusters and --repeat must be positive" << std::endl;
+        return 1;
+    }
+
+    try {
+        MemoryManager mm;
+        auto x = GaussianBlobs(mm, config.Rows, config.Cols, config.Clusters, 1.0, config.Seed, NULL);
+        Bench bench(config);
+        BenchMemoryManager(bench);
+        BenchKernels(bench, x);
+        BenchTSV(bench, x);
+        BenchModels(bench, x);
+        bench.Json(std::cout);
+    } catch(const char* err) {
+        std::cerr << err << std::endl;
+        return 1;
+    }
+    return 0;
+}
+// g++ -O2 numxd_bench.cpp -o numxd_bench -Wall -I./ -pthread
@@ -1,7 +1,13 @@
 
+#include "distance.h"
 #include "kmeans.h"
+#include "metrics.h"
+#include "npy.h"
 #include "numxd.h"
 #include "preprocessing.h"
+#include "quantize.h"
+#include "snapshot.h"
+#include "sparse.h"
 #include "tsv.h"
 
 Num1D<int> Test1Sub(Num1D<int> src, Num1D<int> dst) {
@@ -51,6 +57,281 @@ void TestTSV() {
     Dump2D(X);
 }
 
+void TestTSVParallel() {
+    MemoryManager mm;
+    auto expect = TSV::ToDouble(mm, TSV::Read("./seeds_dataset.txt"));
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt", 4);
+    int diff = 0;
+    for(int m = 0; m < data.Row; m += 1) {
+        for(int n = 0; n < data.Col; n += 1) {
+            diff += (data[m][n] != expect[m][n]);
+        }
+    }
+    printf("rows=%ld, cols=%ld, diff=%d\n", data.Row, data.Col, diff);
+}
+
+void TestTSVWrite() {
+    MemoryManager mm;
+    std::mt19937 mt(1);
+    std::normal_distribution<double> normal(0, 1);
+    Num2D<double> n2d(mm);
+    // 100000 x 4 is several 4 MB write blocks, and the values span many exponents
+    auto x = n2d.Create(100000, 4);
+    for(long int i = 0; i < x.Row * x.Col; i += 1) {
+        x.Value[i] = normal(mt) * pow(10.0, (int)(i % 41) - 20);
+    }
+    x[0][0] = 0.1;
+    x[0][1] = 1e-300;
+    auto readFile = [](const char* fileName) {
+        std::ifstream ifs(fileName, std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    };
+    
+    // any thread count writes the same bytes; only the shortest form (-1) reads back bit for bit
+    Parallel::SetThreads(4);
+    int precisions[2] = {-1, 15};
+    for(int p = 0; p < 2; p += 1) {
+        int results = TSV::Write("./cp_write_1.txt", x, precisions[p], 1) + TSV::Write("./cp_write_4.txt", x, precisions[p], 4);
+        auto single = readFile("./cp_write_1.txt");
+        auto multi = readFile("./cp_write_4.txt");
+        auto back = TSV::ReadParallel(mm, "./cp_write_4.txt");
+        int diff = memcmp(back.Value, x.Value, sizeof(double) * x.Row * x.Col);
+        printf("precision=%d, results=%d, bytes=%lu, same=%d, exact=%d\n", precisions[p], results, single.size(), single == multi, diff == 0);
+        back.Release();
+    }
+    Parallel::SetThreads(Parallel::DefaultThreads());
+    
+    Num1D<Label> n1d(mm);
+    auto labels = n1d.Create(5);
+    for(int i = 0; i < 5; i += 1) {
+        labels[i] = i * 100000;
+    }
+    TSV::Write("./cp_write_labels.txt", labels);
+    auto text = readFile("./cp_write_labels.txt");
+    std::replace(text.begin(), text.end(), '\n', ' ');
+    printf("labels: %s\n", text.c_str());
+}
+
+void TestTSVBatch() {
+    MemoryManager mm;
+    auto expect = TSV::ToDouble(mm, TSV::Read("./seeds_dataset.txt"));
+    auto expectTotal = expect.Total();
+    
+    SpotNum1D<double> n1d;
+    auto total = n1d.Zeros(expect.Col);
+    long int rows = 0;
+    TSV::BatchReader reader(mm, "./seeds_dataset.txt", 64, true);
+    while(true) {
+        auto batch = reader.Next();
+        if(batch.Row == 0) {
+            break;
+        }
+        auto batchTotal = batch.Total();
+        for(int n = 0; n < batch.Col; n += 1) {
+            total[n] += batchTotal[n];
+        }
+        batchTotal.Release();
+        rows += batch.Row;
+    }
+    printf("rows=%ld\n", rows);
+    Dump1D(expectTotal);
+    Dump1D(total);
+    
+    // the scaler fitted batch by batch has to match one PartialFit over the whole data
+    StandardScaler whole;
+    whole.PartialFit(expect);
+    StandardScaler streamed;
+    TSV::BatchReader batches(mm, "./seeds_dataset.txt", 64);
+    streamed.Fit(batches);
+    double diff = 0;
+    for(int n = 0; n < expect.Col; n += 1) {
+        diff = std::max(diff, fabs(streamed.Mean[n] - whole.Mean[n]) + fabs(streamed.StdDev[n] - whole.StdDev[n]));
+    }
+    printf("samples=%ld, scaler diff=%g\n", streamed.Samples, diff);
+    if(streamed.Samples != expect.Row || diff > 1e-12) {
+        throw Format("error in %s: %d, scaler diff %g", __FUNCTION__, __LINE__, diff);
+    }
+}
+
+void TestNpy() {
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    NPY::Save("./cp_seeds.npy", data);
+    NPY::MappedNum2D<double> mapped("./cp_seeds.npy");
+    int diff = memcmp(data.Value, mapped.Value, sizeof(double) * data.Row * data.Col);
+    printf("rows=%ld, cols=%ld, diff=%d\n", mapped.Row, mapped.Col, diff);
+    
+    Num1D<int> n1d(mm);
+    auto indexes = n1d.Arange(0, 10);
+    NPY::Save("./cp_indexes.npy", indexes);
+    auto loaded = NPY::Load1D<int>(mm, "./cp_indexes.npy");
+    Dump1D(loaded);
+}
+
+void TestBackingStore() {
+    MemoryManager mm;
+    mm.SetBackingStore("/tmp", 1 << 20);
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    Num2D<double> n2d(mm);
+    auto large = n2d.Create(100000, data.Col);
+    for(int m = 0; m < large.Row; m += 1) {
+        memcpy(large[m], data[m % data.Row], sizeof(double) * data.Col);
+    }
+    mm.Advise(large.Value, MADV_WILLNEED);
+    auto mean = large.Mean();
+    Dump1D(mean);
+    
+    // the same rows in ordinary memory have to give the same mean, bit for bit
+    MemoryManager heap;
+    Num2D<double> heapN2d(heap);
+    auto expect = heapN2d.Create(large.Row, large.Col);
+    for(int m = 0; m < expect.Row; m += 1) {
+        memcpy(expect[m], data[m % data.Row], sizeof(double) * data.Col);
+    }
+    auto expectMean = expect.Mean();
+    int mapped = mm.Mapped[mm.FindPointer(large.Value)];
+    int diff = memcmp(mean.Value, expectMean.Value, sizeof(double) * mean.Count);
+    printf("mapped=%d, diff=%d\n", mapped, diff);
+    if(!mapped || diff != 0) {
+        throw Format("error in %s: %d, mapped=%d, diff=%d", __FUNCTION__, __LINE__, mapped, diff);
+    }
+}
+
+void TestLargeIndex() {
+    // 3 x 2^30 elements, past what an int can index; the file-backed block is sparse, only touched pages exist
+    MemoryManager mm;
+    mm.SetBackingStore("/tmp", 1 << 20);
+    Num2D<char> n2d(mm);
+    auto x = n2d.Create(3, 1L << 30);
+    const long int last = x.Col - 1;
+    x[2][last] = 7;
+    x.At(1, last) = 5;
+    auto column = x.ColView(last).Val();
+    auto block = x.Block(1, 3, last - 1, x.Col).Val();
+    Num1D<char> flat(mm, x.Row * x.Col, x.Value);
+    auto tail = flat.SliceView(flat.Count - 16, flat.Count).Val();
+    Num1D<long int> n1d(mm);
+    auto indexes = n1d.Create(2);
+    indexes[0] = 2;
+    indexes[1] = 0;
+    auto selected = x.IndexView(indexes);
+    printf("elements=%ld, offset=%ld, column=%d/%d/%d, block=%d/%d, flat=%d, argmax=%ld, selected=%d/%d\n",
+        flat.Count, &x[2][last] - x.Value, column[0], column[1], column[2], block.At(0, 1), block.At(1, 1),
+        flat[flat.Count - 1], tail.ArgReduce(ReduceArgMax), selected(0, last), selected(1, last));
+}
+
+void TestMemoryStats() {
+    // build with -DNUMXD_MEMORY_STATS for the full statistics
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    {
+        MemoryTag tag(mm, "TestMemoryStats");
+        for(int i = 0; i < 3; i += 1) {
+            auto mean = data.Mean();
+            auto power = data.Power(2);
+            mean.Release();
+            power.Release();
+        }
+    }
+    auto block = mm.Alloc(100, "raw");
+    auto snapshot = mm.Snapshot();
+    std::cout << snapshot.Json() << std::endl;
+    mm.Release(block);
+    mm.Report();
+}
+
+void TestChecks() {
+    // -DNUMXD_CHECK_LEVEL=0 removes both checks, 1 (default) keeps the shape check, 2 adds the index check
+    MemoryManager mm;
+    Num2D<double> n2d(mm);
+    auto a = n2d.Create(3, 4);
+    auto b = n2d.Create(4, 3);
+    memset(a.Value, 0, sizeof(double) * 12);
+    memset(b.Value, 0, sizeof(double) * 12);
+    try {
+        (a + b).Release();
+        printf("no shape check\n");
+    } catch(const char* err) {
+        std::cout << err << std::endl;
+    }
+#if NUMXD_CHECK_LEVEL >= 2
+    // below level 2 this read would run past the end of a
+    try {
+        printf("a(3, 0)=%f\n", a.View()(3, 0));
+    } catch(const char* err) {
+        std::cout << err << std::endl;
+    }
+#endif
+}
+
+void TestView() {
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    auto features = data.Block(0, data.Row, 0, 7);
+    auto labels = data.ColView(7);
+    
+    Num1D<long int> n1d(mm);
+    auto idxs = n1d.Create(3);
+    idxs[0] = 0;
+    idxs[1] = 70;
+    idxs[2] = 140;
+    auto selected = data.IndexView(idxs);
+    
+    Dump1D(features.Mean());
+    printf("label total=%f, mean=%f\n", labels.Total(), labels.Mean());
+    Dump1D(selected.Mean());
+    Dump2D(features.Block(0, 2, 5, 7).Val());
+}
+
+void TestLayout() {
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    auto colMajor = data.ToColMajor();
+    Dump1D(data.StdDev());
+    Dump1D(colMajor.StdDev());
+    Dump1D(colMajor.ValT(colMajor, 7).SliceView(0, 210, 70).Val());
+    NPY::Save("./cp_seeds_f.npy", colMajor);
+    NPY::MappedNum2D<double, ColMajor> mapped("./cp_seeds_f.npy");
+    auto back = mapped.ToRowMajor();
+    printf("diff=%d\n", memcmp(back.Value, data.Value, sizeof(double) * data.Row * data.Col));
+}
+
+void TestReduce() {
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    Dump1D(data.Reduce(0, ReduceMin));
+    Dump1D(data.Reduce(0, ReduceMax));
+    Dump1D(data.ArgReduce(0, ReduceArgMax));
+    Dump1D(data.ToColMajor().Reduce(0, ReduceMean, 4));
+    printf("total=%f, argmin=%ld\n", data.TotalX(), data.ColView(0).Val().ArgReduce(ReduceArgMin));
+    
+    // gathered rows go through the same engine, a plain running sum of 0.1 drifts in the 11th digit
+    Num2D<double> n2d(mm);
+    Num1D<long int> n1d(mm);
+    auto tenths = n2d.Create(1000000, 1);
+    for(long int m = 0; m < tenths.Row; m += 1) {
+        tenths[m][0] = 0.1;
+    }
+    auto all = n1d.Arange(0, tenths.Row);
+    printf("indexed total=%.17g, total=%.17g\n", tenths.IndexView(all).Total()[0], tenths.TotalX());
+}
+
+void TestBroadcast() {
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    auto mu = data.Mean();
+    auto invSigma = data.StdDev();
+    for(int n = 0; n < invSigma.Count; n += 1) {
+        invSigma[n] = 1 / invSigma[n];
+    }
+    auto bias = Broadcast::Evaluate(mm, Broadcast::LazyCol(data.ColView(7)) * 0.5);
+    auto fused = Broadcast::Evaluate(mm, (Broadcast::Lazy(data) - mu) * invSigma + bias, 2);
+    Dump2D(fused.Block(0, 3, 0, fused.Col).Val());
+    
+    Broadcast::Assign(data, Broadcast::Lazy(data) * 2.0 - 1.0);
+    Dump1D(data.Mean());
+}
+
 void TestScaler() {
     try {
         MemoryManager mm;
@@ -73,7 +354,7 @@ void TestKMeans() {
     auto tsvData = TSV::Read("./seeds_dataset.txt");
     auto data = TSV::ToDouble(mm, tsvData);
     
-    Num1D<int> n1d(mm);
+    Num1D<long int> n1d(mm);
     Num2D<double> n2d(mm);
     
     auto xIndexes = n1d.Arange(0, 7);
@@ -100,16 +381,527 @@ void TestKMeans() {
     TSV::Write("./cp_predict.txt", predict);
 }
 
+void TestKMeansObserver() {
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    auto features = data.Block(0, data.Row, 0, 7).Val();
+    StandardScaler scaler(features);
+    scaler.Fit();
+    auto scaledX = scaler.Transform(mm);
+    
+    KMeans km(3);
+    km.Initialize(scaledX, KMeans::enumInitializeRandom);
+    km.Observer = [](const KMeansIteration& iteration) {
+        printf("iteration=%d, shift=%f, inertia=%f, sizes=%ld/%ld/%ld\n", iteration.Iteration, iteration.Shift, iteration.Inertia,
+            iteration.ClusterSizes[0], iteration.ClusterSizes[1], iteration.ClusterSizes[2]);
+        return iteration.Iteration < 4;
+    };
+    km.Training(scaledX, 100, 1e-5);
+    std::cout << km.Summary.Json() << std::endl;
+    
+    km.Observer = nullptr;
+    km.Training(scaledX, 3, 1e-5);
+    printf("iterations=%d, converged=%d\n", km.Summary.Iterations, km.Summary.Converged);
+}
+
+void TestPredict() {
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    auto features = data.Block(0, data.Row, 0, 7).Val();
+    KMeans km(3);
+    km.Initialize(features, KMeans::enumInitializeRandom);
+    km.Training(features, 100, 1e-5);
+    auto predict = km.GetPredict(mm, features);
+    
+    const KMeans& model = km;
+    std::vector<std::thread> threads;
+    std::vector<int> mismatch(4, 0);
+    for(int t = 0; t < 4; t += 1) {
+        threads.push_back(std::thread([&, t]() {
+            for(int m = t; m < features.Row; m += 4) {
+                double distance;
+                if(model.Predict(features[m], features.Col, &distance) != predict[m]) {
+                    mismatch[t] += 1;
+                }
+            }
+        }));
+    }
+    for(auto thread = threads.begin(); thread != threads.end(); thread++) {
+        thread->join();
+    }
+    printf("mismatch=%d\n", mismatch[0] + mismatch[1] + mismatch[2] + mismatch[3]);
+    
+    int cluster[2];
+    double distance[2];
+    model.Predict(features[0], 2, features.Col, cluster, distance);
+    printf("cluster=%d/%d, squared distance=%f/%f\n", cluster[0], cluster[1], distance[0], distance[1]);
+}
+
+void TestSnapshot() {
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    auto features = data.Block(0, data.Row, 0, 7).Val();
+    StandardScaler scaler(features);
+    scaler.Fit();
+    auto scaledX = scaler.Transform(mm);
+    KMeans km(3);
+    km.Initialize(scaledX, KMeans::enumInitializeRandom);
+    km.Training(scaledX, 100, 1e-5);
+    printf("save=%d/%d\n", scaler.Save("./cp_scaler.snp"), km.Save("./cp_kmeans.snp"));
+    
+    StandardScaler loadedScaler;
+    loadedScaler.Load("./cp_scaler.snp");
+    auto loadedX = loadedScaler.Transform(mm, features);
+    printf("scaled diff=%d\n", memcmp(loadedX.Value, scaledX.Value, sizeof(double) * scaledX.Row * scaledX.Col));
+    
+    KMeans loaded(3);
+    loaded.Load("./cp_kmeans.snp");
+    MappedKMeans mapped("./cp_kmeans.snp");
+    auto predict = km.GetPredict(mm, scaledX);
+    auto loadedPredict = loaded.GetPredict(mm, scaledX);
+    auto mappedPredict = mapped.GetPredict(mm, scaledX);
+    printf("predict diff=%d/%d\n", memcmp(predict.Value, loadedPredict.Value, sizeof(int) * predict.Count),
+        memcmp(predict.Value, mappedPredict.Value, sizeof(int) * predict.Count));
+    Dump1D(mapped.CentroidNorms);
+    
+    FILE* fp = fopen("./cp_kmeans.snp", "r+b");
+    fseek(fp, 200, SEEK_SET);
+    fputc(0x55, fp);
+    fclose(fp);
+    try {
+        MappedKMeans broken("./cp_kmeans.snp");
+    } catch(const char* err) {
+        std::cout << err << std::endl;
+    }
+    
+    // a negative row count, a size that wraps around and a misaligned offset in the first section entry
+    for(int c = 0; c < 3; c += 1) {
+        km.Save("./cp_kmeans.snp");
+        fp = fopen("./cp_kmeans.snp", "r+b");
+        int64_t row = (c == 0) ? -1 : INT64_MAX / 4;
+        uint64_t offset;
+        fseek(fp, Snapshot::HeaderSize + 32, SEEK_SET);
+        if(fread(&offset, 8, 1, fp) != 1) {
+            throw Format("error in %s: %d, short snapshot", __FUNCTION__, __LINE__);
+        }
+        offset += 8;
+        fseek(fp, Snapshot::HeaderSize + ((c < 2) ? 16 : 32), SEEK_SET);
+        fwrite((c < 2) ? (const void*)&row : (const void*)&offset, 8, 1, fp);
+        fclose(fp);
+        try {
+            Snapshot::File crafted("./cp_kmeans.snp", Snapshot::KindKMeans, false);
+            printf("crafted section %d accepted\n", c);
+        } catch(const char* err) {
+            std::cout << err << std::endl;
+        }
+    }
+}
+
+void TestCentroidIndex() {
+    MemoryManager mm;
+    std::mt19937 mt(1);
+    std::normal_distribution<double> normal(0, 1);
+    Num2D<double> n2d(mm);
+    auto x = n2d.Create(5000, 4);
+    for(long int i = 0; i < (long int)x.Row * x.Col; i += 1) {
+        x.Value[i] = normal(mt);
+    }
+    KMeans km(256);
+    km.Initialize(x, KMeans::enumInitializeRandom);
+    km.Training(x, 5, 1e-5);
+    auto exact = km.GetPredict(mm, x);
+    
+    km.BuildIndex();
+    auto indexed = km.GetPredict(mm, x);
+    km.BuildIndex(0.5);
+    auto approximate = km.GetPredict(mm, x);
+    int mismatch = 0;
+    int hit = 0;
+    for(int m = 0; m < x.Row; m += 1) {
+        mismatch += (indexed[m] != exact[m]);
+        hit += (approximate[m] == exact[m]);
+    }
+    printf("exact mismatch=%d, approximate recall=%f\n", mismatch, (double)hit / x.Row);
+    
+    // 512 centroids over 4 features are enough for the tree to pay off
+    KMeans scanKm(512);
+    KMeans indexedKm(512);
+    scanKm.Initialize(x, KMeans::enumInitializeRandom);
+    indexedKm.Initialize(x, KMeans::enumInitializeRandom);
+    indexedKm.IndexedTraining = true;
+    scanKm.Training(x, 5, 1e-5);
+    indexedKm.Training(x, 5, 1e-5);
+    printf("indexed=%d/%d, inertia=%f/%f\n", km.IndexPaysOff(x.Col), indexedKm.IndexPaysOff(x.Col), scanKm.Summary.Inertia, indexedKm.Summary.Inertia);
+}
+
+void TestDistance() {
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    auto x = data.Block(0, data.Row, 0, 7).Val();
+    auto a = x.Block(0, 3, 0, x.Col).Val();
+    Dump2D(Distance::CDist(mm, a, x, MetricEuclidean).Block(0, 3, 0, 4).Val());
+    Dump2D(Distance::CDist(mm, a, x, MetricCosine).Block(0, 3, 0, 4).Val());
+    Dump2D(Distance::CDist(mm, a, x, MetricManhattan).Block(0, 3, 0, 4).Val());
+    
+    auto full = Distance::CDist(mm, x, x, MetricSquaredEuclidean, 3);
+    auto condensed = Distance::PDist(mm, x, MetricSquaredEuclidean, 2);
+    int mismatch = 0;
+    for(int m = 0, k = 0; m < x.Row; m += 1) {
+        for(int n = m + 1; n < x.Row; n += 1, k += 1) {
+            mismatch += (full[m][n] != condensed[k]);
+        }
+    }
+    double maximum = 0;
+    Distance::CDistTiles<double>(x, x, MetricEuclidean, [&](const Distance::Tile<double>& tile) {
+        for(int i = 0; i < tile.Rows * tile.Stride; i += 1) {
+            maximum = std::max(maximum, (i % tile.Stride < tile.Cols) ? tile.Value[i] : 0);
+        }
+    });
+    Num1D<double> n1d(mm);
+    printf("pdist mismatch=%d, max=%f, x0-x1=%f\n", mismatch, maximum, n1d.CalcDistance(x.RowView(0), x.RowView(1)));
+}
+
+void TestSparse() {
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    auto features = data.Block(0, data.Row, 0, 7).Val();
+    // one-hot label columns next to sparsified features
+    Num2D<double> n2d(mm);
+    auto dense = n2d.Create(data.Row, 10);
+    for(int m = 0; m < dense.Row; m += 1) {
+        for(int n = 0; n < 7; n += 1) {
+            dense[m][n] = (features[m][n] > 5) ? features[m][n] : 0;
+        }
+        for(int n = 7; n < 10; n += 1) {
+            dense[m][n] = (data[m][7] == n - 6) ? 1 : 0;
+        }
+    }
+    TSV::Write("./cp_sparse.txt", dense);
+    auto csr = Sparse::ReadTSV(mm, "./cp_sparse.txt");
+    printf("nnz=%ld, density=%f\n", csr.Nnz, csr.Density());
+    Dump1D(csr.Mean(mm));
+    Dump1D(dense.Mean());
+    Dump1D(csr.StdDev(mm));
+    Dump1D(dense.StdDev());
+    
+    SparseScaler scaler(csr);
+    scaler.Fit();
+    auto scaled = scaler.Transform(mm);
+    auto scaledDense = scaled.ToDense(mm);
+    
+    KMeans sparseKm(3);
+    sparseKm.Initialize(scaled, KMeans::enumInitializeRandom);
+    sparseKm.Training(scaled, 100, 1e-5);
+    KMeans denseKm(3);
+    denseKm.Initialize(scaledDense, KMeans::enumInitializeRandom);
+    denseKm.Training(scaledDense, 100, 1e-5);
+    auto sparsePredict = sparseKm.GetPredict(mm, scaled);
+    auto densePredict = denseKm.GetPredict(mm, scaledDense);
+    int mismatch = 0;
+    for(int m = 0; m < data.Row; m += 1) {
+        mismatch += (sparsePredict[m] != densePredict[m]);
+    }
+    printf("iterations=%d/%d, inertia=%f/%f, mismatch=%d\n", sparseKm.Summary.Iterations, denseKm.Summary.Iterations,
+        sparseKm.Summary.Inertia, denseKm.Summary.Inertia, mismatch);
+}
+
+void TestParallel() {
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    auto features = data.Block(0, data.Row, 0, 7).Val();
+    Num2D<double> n2d(mm);
+    auto big = n2d.Create(features.Row * 200, features.Col);
+    for(int m = 0; m < big.Row; m += 1) {
+        memcpy(big[m], features[m % features.Row], sizeof(double) * big.Col);
+    }
+    KMeans seed(3);
+    seed.Initialize(features, KMeans::enumInitializeRandom);
+    seed.Training(features, 100, 1e-5);
+    
+    // every result has to be the same, bit for bit, for any thread count
+    int counts[2] = {1, 4};
+    for(int t = 0; t < 2; t += 1) {
+        Parallel::SetThreads(counts[t]);
+        auto mean = big.Mean();
+        auto sum = big + big;
+        auto transposed = big.Transpose();
+        StandardScaler scaler(big);
+        scaler.Fit();
+        auto scaled = scaler.Transform(mm);
+        KMeans km(3);
+        km.InitCentroids.Release();
+        km.InitCentroids = seed.Centroids;
+        km.Training(big, 100, 1e-5);
+        printf("threads=%d, mean[0]=%.17g, total=%.17g, sum=%.17g, transposed=%.17g, scaled=%.17g, inertia=%.17g, iterations=%d\n",
+            Parallel::Threads(), mean[0], big.TotalX(), sum.TotalX(), transposed[6][big.Row - 1], scaled.TotalX(), km.Summary.Inertia, km.Summary.Iterations);
+        mean.Release();
+        sum.Release();
+        transposed.Release();
+        scaled.Release();
+    }
+    
+    long int total = Parallel::ParallelReduce(0, 1000000, 1000, 0L, [](long int begin, long int end) {
+        long int partial = 0;
+        for(long int i = begin; i < end; i += 1) {
+            partial += i;
+        }
+        return partial;
+    }, std::plus<long int>());
+    printf("reduce=%ld\n", total);
+    try {
+        Parallel::ParallelFor(0, 100000, 100, [](long int begin, long int end) {
+            if(begin <= 50000 && 50000 < end) {
+                throw "chunk failed";
+            }
+        });
+    } catch(const char* err) {
+        printf("caught: %s\n", err);
+    }
+    Parallel::SetThreads(Parallel::DefaultThreads());
+}
+
+void TestWarmStart() {
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    auto features = data.Block(0, data.Row, 0, 7).Val();
+    StandardScaler scaler(features);
+    scaler.Fit();
+    auto scaledX = scaler.Transform(mm);
+    // yesterday is rows [0, 180), today drops rows [0, 10) and appends rows [180, 210)
+    auto yesterday = scaledX.Block(0, 180, 0, scaledX.Col).Val();
+    auto today = scaledX.Block(10, scaledX.Row, 0, scaledX.Col).Val();
+    auto removedRows = scaledX.Block(0, 10, 0, scaledX.Col).Val();
+    Num1D<long int> n1d(mm);
+    auto removed = n1d.Arange(0, 10);
+    
+    KMeans km(3);
+    km.Initialize(yesterday, KMeans::enumInitializeRandom);
+    km.Training(yesterday, 100, 1e-5);
+    km.Refresh(yesterday, 100, 1e-5);
+    printf("first refresh: iterations=%d, state rows=%ld\n", km.Summary.Iterations, km.WarmState.Rows());
+    auto previous = km.GetCentroids(mm);
+    km.Observer = [](const KMeansIteration& iteration) {
+        printf("iteration=%d, scanned=%ld, shift=%f, inertia=%f\n", iteration.Iteration, iteration.Scanned, iteration.Shift, iteration.Inertia);
+        return true;
+    };
+    km.Refresh(today, removed, removedRows, 100, 1e-5);
+    km.Observer = nullptr;
+    
+    // a cold Training from the same centroids has to reach the same means
+    KMeans cold(3);
+    cold.InitCentroids.Release();
+    cold.InitCentroids = previous;
+    cold.Training(today, 100, 1e-5);
+    double diff = 0;
+    for(int m = 0; m < km.Centroids.Row; m += 1) {
+        for(int n = 0; n < km.Centroids.Col; n += 1) {
+            diff = std::max(diff, fabs(km.Centroids[m][n] - cold.Centroids[m][n]));
+        }
+    }
+    auto warmPredict = km.GetPredict(mm, today);
+    auto coldPredict = cold.GetPredict(mm, today);
+    int mismatch = 0;
+    for(int m = 0; m < today.Row; m += 1) {
+        mismatch += (warmPredict[m] != coldPredict[m]) + (warmPredict[m] != km.WarmState.Assign[m]);
+    }
+    printf("iterations=%d/%d, inertia=%f/%f, centroid diff=%g, mismatch=%d\n", km.Summary.Iterations, cold.Summary.Iterations,
+        km.Summary.Inertia, cold.Summary.Inertia, diff, mismatch);
+    if(mismatch != 0 || fabs(km.Summary.Inertia - cold.Summary.Inertia) > 1e-9 * cold.Summary.Inertia) {
+        throw Format("error in %s: %d, warm inertia %f, cold %f", __FUNCTION__, __LINE__, km.Summary.Inertia, cold.Summary.Inertia);
+    }
+
+    // far from the origin the inertia from the running sums must not cancel; every call moves the first 10 rows to
+    // the end, over more calls than RebuildEvery
+    for(long int i = 0; i < today.Row * today.Col; i += 1) {
+        today.Value[i] += 1e6;
+    }
+    KMeans far(3);
+    far.InitCentroids.Release();
+    far.InitCentroids = cold.GetCentroids(mm);
+    for(long int i = 0; i < far.InitCentroids.Row * far.InitCentroids.Col; i += 1) {
+        far.InitCentroids.Value[i] += 1e6;
+    }
+    far.Training(today, 100, 1e-5);
+    far.Refresh(today, 100, 1e-5);
+    Num2D<double> n2d(mm);
+    auto current = n2d.Clone(today);
+    for(int call = 0; call <= KMeansWarmState::RebuildEvery; call += 1) {
+        auto moved = current.Block(0, 10, 0, current.Col).Val();
+        auto next = n2d.Create(current.Row, current.Col);
+        memcpy(next.Value, current[10], sizeof(double) * (current.Row - 10) * current.Col);
+        memcpy(next[current.Row - 10], moved.Value, sizeof(double) * 10 * current.Col);
+        far.Refresh(next, removed, moved, 100, 1e-5);
+        current.Release();
+        moved.Release();
+        current = next;
+    }
+    KMeans farCold(3);
+    farCold.InitCentroids.Release();
+    farCold.InitCentroids = far.GetCentroids(mm);
+    farCold.Training(current, 100, 1e-5);
+    double error = fabs(far.Summary.Inertia - farCold.Summary.Inertia) / farCold.Summary.Inertia;
+    printf("far from the origin: inertia=%f/%f, updates=%d\n", far.Summary.Inertia, farCold.Summary.Inertia, far.WarmState.Updates);
+    if(error > 1e-6) {
+        throw Format("error in %s: %d, warm inertia %f, cold %f", __FUNCTION__, __LINE__, far.Summary.Inertia, farCold.Summary.Inertia);
+    }
+}
+
+void TestMetrics() {
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    auto features = data.Block(0, data.Row, 0, 7).Val();
+    StandardScaler scaler(features);
+    scaler.Fit();
+    auto scaledX = scaler.Transform(mm);
+    KMeans km(3);
+    km.Initialize(scaledX, KMeans::enumInitializeRandom);
+    km.Training(scaledX, 100, 1e-5);
+    auto predict = km.GetPredict(mm, scaledX);
+    printf("inertia=%f/%f\n", km.Summary.Inertia, Metrics::Inertia(scaledX, predict, km.Centroids));
+    
+    // the O(N^2) definition row by row
+    Num1D<double> n1d(mm);
+    double naive = 0;
+    for(int m = 0; m < scaledX.Row; m += 1) {
+        double totals[3] = {0, 0, 0};
+        long int sizes[3] = {0, 0, 0};
+        for(int n = 0; n < scaledX.Row; n += 1) {
+            totals[predict[n]] += n1d.CalcDistance(scaledX.RowView(m), scaledX.RowView(n));
+            sizes[predict[n]] += 1;
+        }
+        double a = totals[predict[m]] / (sizes[predict[m]] - 1);
+        double b = 1e300;
+        for(int cluster = 0; cluster < 3; cluster += 1) {
+            if(cluster != predict[m]) {
+                b = std::min(b, totals[cluster] / sizes[cluster]);
+            }
+        }
+        naive += (b - a) / std::max(a, b);
+    }
+    naive /= scaledX.Row;
+    Parallel::SetThreads(4);
+    double silhouette = Metrics::Silhouette(scaledX, predict);
+    Parallel::SetThreads(Parallel::DefaultThreads());
+    printf("silhouette=%f, naive=%f\n", silhouette, naive);
+    
+    auto estimate = Metrics::SampledSilhouette(scaledX, predict, 50);
+    printf("sampled=%f in [%f, %f] from %ld\n", estimate.Score, estimate.Lower, estimate.Upper, estimate.Samples);
+    auto all = Metrics::SampledSilhouette(scaledX, predict, scaledX.Row);
+    printf("all=%f in [%f, %f]\n", all.Score, all.Lower, all.Upper);
+    printf("davies-bouldin=%f, calinski-harabasz=%f\n", Metrics::DaviesBouldin(scaledX, predict), Metrics::CalinskiHarabasz(scaledX, predict));
+}
+
+void TestQuantize() {
+    float values[6] = {0.0f, -1.5f, 3.14159265f, 65504.0f, 1e-7f, 1e6f};
+    for(int i = 0; i < 6; i += 1) {
+        printf("%g: fp16=%g, bf16=%g\n", values[i], Quantize::HalfToFloat(Quantize::FloatToHalf(values[i])),
+            Quantize::BFloat16ToFloat(Quantize::FloatToBFloat16(values[i])));
+    }
+    
+    MemoryManager mm;
+    auto data = TSV::ReadParallel(mm, "./seeds_dataset.txt");
+    auto features = data.Block(0, data.Row, 0, 7).Val();
+    StandardScaler scaler(features);
+    scaler.Fit();
+    auto scaledX = scaler.Transform(mm);
+    KMeans km(3);
+    km.Initialize(scaledX, KMeans::enumInitializeRandom);
+    km.Training(scaledX, 100, 1e-5);
+    auto mean = scaledX.Mean();
+    
+    // means (0, 0) and (0.6, 0): rows at x = 0.3 +- 1e-9 sit on the bisector and decode to the same x, so only
+    // the exact rows can tell them apart. Two rows at x = +-5 make the int8 steps coarse.
+    Num2D<double> n2d(mm);
+    auto means = n2d.Create(2, 2);
+    memset(means.Value, 0, sizeof(double) * 4);
+    means[1][0] = 0.6;
+    auto ties = n2d.Create(202, 2);
+    std::vector<Label> exact(ties.Row);
+    for(int m = 0; m < ties.Row; m += 1) {
+        ties[m][0] = (m < 200) ? 0.3 + ((m % 2) ? 1e-9 : -1e-9) : ((m == 200) ? -5 : 5);
+        ties[m][1] = (m % 100) / 100.0;
+        exact[m] = (ties[m][0] > 0.3) ? 1 : 0;
+    }
+    
+    Quantized2D q2d(mm);
+    int formats[3] = {QuantFloat16, QuantBFloat16, QuantInt8};
+    for(int f = 0; f < 3; f += 1) {
+        auto quantized = q2d.FromDense(scaledX, formats[f]);
+        auto decoded = quantized.ToDense(mm);
+        double error = 0;
+        for(long int i = 0; i < scaledX.Row * scaledX.Col; i += 1) {
+            error = std::max(error, fabs(decoded.Value[i] - scaledX.Value[i]));
+        }
+        auto quantizedMean = quantized.Mean(mm);
+        
+        // with the exact rows the near ties are settled exactly, without them half of them go wrong
+        auto tied = q2d.FromDense(ties, formats[f], true);
+        Num1D<Label> n1d(mm);
+        auto predict = n1d.Create(ties.Row);
+        KMeans pair(2);
+        long int rescored;
+        pair.QuantizedAssign(means.Value, tied, predict.Value, &rescored);
+        int mismatch = 0;
+        for(int m = 0; m < ties.Row; m += 1) {
+            mismatch += (predict[m] != exact[m]);
+        }
+        tied.Source.Value = NULL;
+        pair.QuantizedAssign(means.Value, tied, predict.Value);
+        int approximate = 0;
+        for(int m = 0; m < ties.Row; m += 1) {
+            approximate += (predict[m] != exact[m]);
+        }
+        if(rescored < 200 || mismatch != 0 || approximate == 0) {
+            throw Format("error in %s: %d, format %d: rescored=%ld, mismatch=%d/%d", __FUNCTION__, __LINE__, formats[f], rescored, mismatch, approximate);
+        }
+        
+        KMeans qkm(3);
+        qkm.InitCentroids.Release();
+        qkm.InitCentroids = km.InitCentroids;
+        qkm.Training(quantized, 100, 1e-5);
+        printf("format=%d, bytes=%ld/%ld, max error=%f, mean[0]=%f/%f, rescored=%ld, mismatch=%d/%d, inertia=%f/%f\n",
+            formats[f], quantized.Bytes(), (long int)sizeof(double) * scaledX.Row * scaledX.Col, error, quantizedMean[0], mean[0],
+            rescored, mismatch, approximate, qkm.Summary.Inertia, km.Summary.Inertia);
+        quantized.Release();
+        tied.Release();
+        decoded.Release();
+        quantizedMean.Release();
+        predict.Release();
+    }
+}
+
 int main(int argc, char** argv) {
     //Test1();
     //TestTSV();
+    //TestTSVParallel();
+    //TestTSVWrite();
+    //TestTSVBatch();
+    //TestNpy();
+    //TestBackingStore();
+    //TestLargeIndex();
+    //TestMemoryStats();
+    //TestChecks();
+    //TestView();
+    //TestLayout();
+    //TestReduce();
+    //TestBroadcast();
     //TestScaler();
     TestKMeans();
+    //TestKMeansObserver();
+    //TestPredict();
+    //TestSnapshot();
+    //TestCentroidIndex();
+    //TestDistance();
+    //TestSparse();
+    //TestParallel();
+    //TestWarmStart();
+    //TestMetrics();
+    //TestQuantize();
     return 0;
 }
 // /mnt/d/project/000018_cpp_number
-// g++ numxd_test.cpp -o a.out -Wall -I./
-// g++ -fsanitize=address -fno-omit-frame-pointer -g numxd_test.cpp -o a.out -Wall -I./
+// g++ numxd_test.cpp -o a.out -Wall -I./ -pthread
+// g++ -fsanitize=address -fno-omit-frame-pointer -g numxd_test.cpp -o a.out -Wall -I./ -pthread
 
 // …or create a new repository on the command line
 // echo "# cpp_number" >> README.md
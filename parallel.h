@@ -0,0 +1,283 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// One work-stealing thread pool shared by the whole library, so nested and concurrent parallel loops never
+// start more threads than the global setting. Every worker owns a deque: it pushes and pops at the back and
+// idle workers steal from the front of the others. The thread that calls ParallelFor works on its own loop too.
+//
+// The thread count is NUMXD_THREADS from the environment, else every hardware thread, and can be changed with
+// Parallel::SetThreads. Loops are split into chunks of at least grain iterations whose boundaries depend only on
+// the range and the grain, so ParallelReduce gives the same result for any thread count, and a range shorter
+// than its grain (the 210 x 8 seeds data everywhere) runs inline on the calling thread.
+namespace Parallel {
+    // Element count below which the library's loops stay serial.
+    const long int MinWork = 1 << 15;
+    // Upper bound on the chunks of one loop, so the per-chunk overhead stays small for huge ranges.
+    const long int MaxChunks = 256;
+
+    class Queue {
+        public:
+        std::mutex Mutex;
+        std::deque<std::function<void()>> Tasks;
+    };
+
+    class ThreadPool {
+        public:
+        std::vector<std::unique_ptr<Queue>> Queues;
+        std::vector<std::thread> Workers;
+        std::mutex Mutex;
+        std::condition_variable Wake;
+        long int Pending;
+        bool Stop;
+        std::atomic<unsigned int> Next;
+
+        static int& CurrentWorker() {
+            static thread_local int worker = -1;
+            return worker;
+        }
+
+        ThreadPool(int workers): Pending(0), Stop(false), Next(0) {
+            for(int i = 0; i < workers; i += 1) {
+                this->Queues.push_back(std::unique_ptr<Queue>(new Queue()));
+            }
+            for(int i = 0; i < workers; i += 1) {
+                this->Workers.push_back(std::thread(&ThreadPool::Loop, this, i));
+            }
+        }
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(this->Mutex);
+                this->Stop = true;
+            }
+            this->Wake.notify_all();
+            for(auto worker = this->Workers.begin(); worker != this->Workers.end(); worker++) {
+                worker->join();
+            }
+        }
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        int Size() {
+            return this->Workers.size();
+        }
+
+        // A worker pushes to its own deque, any other thread round-robin.
+        void Submit(std::function<void()> task) {
+            int self = CurrentWorker();
+            int index = (self >= 0) ? self : (int)(this->Next++ % this->Queues.size());
+            {
+                std::lock_guard<std::mutex> lock(this->Queues[index]->Mutex);
+                this->Queues[index]->Tasks.push_back(std::move(task));
+            }
+            {
+                std::lock_guard<std::mutex> lock(this->Mutex);
+                this->Pending += 1;
+            }
+            this->Wake.notify_one();
+        }
+
+        // Runs one task, the newest of self's own deque or the oldest stolen from another; false when there is none.
+        bool RunOne(int self) {
+            std::function<void()> task;
+            const int count = this->Queues.size();
+            for(int i = 0; i < count && !task; i += 1) {
+                int index = (self >= 0) ? (self + i) % count : i;
+                Queue& queue = *this->Queues[index];
+                std::lock_guard<std::mutex> lock(queue.Mutex);
+                if(queue.Tasks.empty()) {
+                    continue;
+                }
+                if(index == self) {
+                    task = std::move(queue.Tasks.back());
+                    queue.Tasks.pop_back();
+                } else {
+                    task = std::move(queue.Tasks.front());
+                    queue.Tasks.pop_front();
+                }
+            }
+            if(!task) {
+                return false;
+            }
+            {
+                std::lock_guard<std::mutex> lock(this->Mutex);
+                this->Pending -= 1;
+            }
+            task();
+            return true;
+        }
+
+        void Loop(int self) {
+            CurrentWorker() = self;
+            while(true) {
+                if(this->RunOne(self)) {
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(this->Mutex);
+                this->Wake.wait(lock, [&]() { return this->Stop || this->Pending > 0; });
+                if(this->Stop) {
+                    return;
+                }
+            }
+        }
+    };
+
+    ////////////////////////////////////////
+    // settings
+    ////////////////////////////////////////
+    int DefaultThreads() {
+        const char* env = getenv("NUMXD_THREADS");
+        if(env != NULL && atoi(env) > 0) {
+            return atoi(env);
+        }
+        return std::max(1, (int)std::thread::hardware_concurrency());
+    }
+
+    std::mutex& PoolMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+    std::unique_ptr<ThreadPool>& PoolInstance() {
+        static std::unique_ptr<ThreadPool> pool;
+        return pool;
+    }
+    int& ThreadSetting() {
+        static int threads = DefaultThreads();
+        return threads;
+    }
+
+    int Threads() {
+        return ThreadSetting();
+    }
+
+    // The pool is rebuilt with threads - 1 workers (the caller is the last thread); must not be called from inside a parallel loop.
+    void SetThreads(int threads) {
+        std::lock_guard<std::mutex> lock(PoolMutex());
+        ThreadSetting() = std::max(1, threads);
+        PoolInstance().reset();
+    }
+
+    ThreadPool& Pool() {
+        std::lock_guard<std::mutex> lock(PoolMutex());
+        auto& pool = PoolInstance();
+        if(!pool) {
+            pool.reset(new ThreadPool(std::max(1, ThreadSetting() - 1)));
+        }
+        return *pool;
+    }
+
+    ////////////////////////////////////////
+    // loops
+    ////////////////////////////////////////
+    // [Begin, End) cut into Chunks pieces of Chunk iterations (the last may be shorter).
+    class Range {
+        public:
+        long int Begin;
+        long int End;
+        long int Chunk;
+        long int Chunks;
+        Range(long int begin, long int end, long int grain): Begin(begin), End(std::max(begin, end)) {
+            const long int count = this->End - this->Begin;
+            this->Chunk = std::max(std::max(1L, grain), (count + MaxChunks - 1) / MaxChunks);
+            this->Chunks = (count + this->Chunk - 1) / this->Chunk;
+        }
+        long int ChunkBegin(long int c) const {
+            return this->Begin + c * this->Chunk;
+        }
+        long int ChunkEnd(long int c) const {
+            return std::min(this->End, this->Begin + (c + 1) * this->Chunk);
+        }
+    };
+
+    class LoopState {
+        public:
+        std::atomic<long int> Next;
+        std::atomic<long int> Done;
+        std::mutex Mutex;
+        std::exception_ptr Error;
+        LoopState(): Next(0), Done(0) {}
+    };
+
+    // Calls f(chunk, begin, end) for every chunk of range, on up to threads threads (<= 0: Threads()).
+    // The first exception thrown by f is rethrown on the calling thread once every chunk has finished.
+    template <typename F>
+    void ForChunks(const Range& range, F f, int threads = 0) {
+        if(threads <= 0) {
+            threads = Threads();
+        }
+        const long int helpers = std::min((long int)threads, range.Chunks) - 1;
+        if(helpers <= 0) {
+            for(long int c = 0; c < range.Chunks; c += 1) {
+                f(c, range.ChunkBegin(c), range.ChunkEnd(c));
+            }
+            return;
+        }
+        // helpers may start after the loop is over, so the state and range they touch are owned by the task
+        // and f is only reached through a chunk they claimed, while the caller is still waiting
+        auto state = std::make_shared<LoopState>();
+        F* body = &f;
+        auto run = [state, body, range]() {
+            long int c;
+            while((c = state->Next++) < range.Chunks) {
+                try {
+                    (*body)(c, range.ChunkBegin(c), range.ChunkEnd(c));
+                } catch(...) {
+                    std::lock_guard<std::mutex> lock(state->Mutex);
+                    if(!state->Error) {
+                        state->Error = std::current_exception();
+                    }
+                }
+                state->Done++;
+            }
+        };
+        ThreadPool& pool = Pool();
+        for(long int i = 0; i < helpers; i += 1) {
+            pool.Submit(run);
+        }
+        run();
+        const int self = ThreadPool::CurrentWorker();
+        while(state->Done < range.Chunks) {
+            if(!pool.RunOne(self)) {
+                std::this_thread::yield();
+            }
+        }
+        if(state->Error) {
+            std::rethrow_exception(state->Error);
+        }
+    }
+
+    // f(begin, end) over disjoint pieces of [begin, end), each at least grain long.
+    template <typename F>
+    void ParallelFor(long int begin, long int end, long int grain, F f, int threads = 0) {
+        Range range(begin, end, grain);
+        ForChunks(range, [&](long int, long int b, long int e) {
+            f(b, e);
+        }, threads);
+    }
+
+    // combine(...combine(combine(identity, map(chunk 0)), map(chunk 1))...), always in chunk order.
+    template <typename T, typename Map, typename Combine>
+    T ParallelReduce(long int begin, long int end, long int grain, T identity, Map map, Combine combine, int threads = 0) {
+        Range range(begin, end, grain);
+        std::vector<T> partials(range.Chunks, identity);
+        ForChunks(range, [&](long int c, long int b, long int e) {
+            partials[c] = map(b, e);
+        }, threads);
+        T result = identity;
+        for(auto partial = partials.begin(); partial != partials.end(); partial++) {
+            result = combine(result, *partial);
+        }
+        return result;
+    }
+};
@@ -2,6 +2,9 @@
 #pragma once
 
 #include <numxd.h>
+#include <snapshot.h>
+#include <sparse.h>
+#include <tsv.h>
 
 class StandardScaler {
     public:
@@ -9,11 +12,16 @@ class StandardScaler {
     Num1D<double> Mean;
     Num1D<double> StdDev;
     Num2D<double> Data;
-    StandardScaler(Num2D<double> data): Mean(mm), StdDev(mm), Data(data) {
+    // PartialFit state: the rows seen so far and the column sums of their squared deviations from Mean
+    long int Samples;
+    std::vector<double> Deviations;
+    StandardScaler(Num2D<double> data): Mean(mm), StdDev(mm), Data(data), Samples(0) {
         Num1D<double> n1d(this->mm);
         this->Mean = n1d.Create(this->Data.Col);
         this->StdDev = n1d.Create(this->Data.Col);
     }
+    // Without data, for Load.
+    StandardScaler(): Mean(mm), StdDev(mm), Data(mm), Samples(0) {}
     
     void Fit() {
         Num2D<double> n2d(this->mm);
@@ -21,17 +29,129 @@ class StandardScaler {
         this->StdDev.Release();
         this->Mean = this->Data.Mean();
         this->StdDev = this->Data.StdDev(1);
+        this->Samples = 0;
     }
     
+    // Adds the rows of batch to Mean and StdDev (ddof 1, as Fit) without keeping them, merging the batch
+    // mean and squared deviations into the running ones (Chan et al.), so the data never has to fit in memory.
+    // The first call after construction, Fit or Load starts over.
+    void PartialFit(Num2D<double> batch) {
+        if(batch.Row == 0) {
+            return;
+        }
+        if(this->Samples == 0) {
+            Num1D<double> n1d(this->mm);
+            if(this->Mean.Value != NULL) {
+                this->Mean.Release();
+                this->StdDev.Release();
+            }
+            this->Mean = n1d.Zeros(batch.Col);
+            this->StdDev = n1d.Zeros(batch.Col);
+            this->Deviations.assign(batch.Col, 0);
+        }
+        if(CheckLevel >= 1 && batch.Col != this->Mean.Count) {
+            throw Format("error in %s: %d, scaler has %ld features, got %ld", __FUNCTION__, __LINE__, this->Mean.Count, batch.Col);
+        }
+        auto batchMean = batch.Mean();
+        std::vector<double> batchDeviations(batch.Col, 0);
+        for(long int m = 0; m < batch.Row; m += 1) {
+            for(long int n = 0; n < batch.Col; n += 1) {
+                const double d = batch[m][n] - batchMean[n];
+                batchDeviations[n] += d * d;
+            }
+        }
+        const double before = this->Samples;
+        const double total = this->Samples + batch.Row;
+        for(long int n = 0; n < batch.Col; n += 1) {
+            const double delta = batchMean[n] - this->Mean[n];
+            this->Mean[n] += delta * batch.Row / total;
+            this->Deviations[n] += batchDeviations[n] + delta * delta * before * batch.Row / total;
+            this->StdDev[n] = (total > 1) ? sqrt(this->Deviations[n] / (total - 1)) : 0;
+        }
+        this->Samples += batch.Row;
+        batchMean.Release();
+    }
+    // PartialFit over every batch of reader.
+    void Fit(TSV::BatchReader& reader) {
+        this->Samples = 0;
+        while(true) {
+            auto batch = reader.Next();
+            if(batch.Row == 0) {
+                break;
+            }
+            this->PartialFit(batch);
+        }
+    }
+    
+    // (Data - Mean) / StdDev in one pass, written straight into memoryManager.
     Num2D<double> Transform(MemoryManager& memoryManager) {
-        Num2D<double> n2d(memoryManager);
-        auto subtract = this->Data.Subtract(this->Mean);
-        auto answer = subtract.Division(this->StdDev);
-        auto response = n2d.Clone(answer);
-        
-        subtract.Release();
-        answer.Release();
-        
-        return response;
+        return Broadcast::Evaluate(memoryManager, (Broadcast::Lazy(this->Data) - this->Mean) / this->StdDev);
+    }
+    Num2D<double> Transform(MemoryManager& memoryManager, Num2D<double> data) {
+        return Broadcast::Evaluate(memoryManager, (Broadcast::Lazy(data) - this->Mean) / this->StdDev);
+    }
+    
+    ////////////////////////////////////////
+    // snapshot
+    ////////////////////////////////////////
+    // inv_std is stored for consumers that scale by multiplication, Load keeps the exact std_dev.
+    int Save(const char* fileName) {
+        Num1D<double> n1d(this->mm);
+        auto invStdDev = n1d.Create(this->StdDev.Count);
+        for(int n = 0; n < invStdDev.Count; n += 1) {
+            invStdDev[n] = 1 / this->StdDev[n];
+        }
+        Snapshot::Writer writer(Snapshot::KindStandardScaler);
+        writer.Add("mean", this->Mean);
+        writer.Add("std_dev", this->StdDev);
+        writer.Add("inv_std", invStdDev);
+        int result = writer.Save(fileName);
+        invStdDev.Release();
+        return result;
+    }
+    
+    void Load(const char* fileName) {
+        Snapshot::File file(fileName, Snapshot::KindStandardScaler);
+        MemoryManager tmp;
+        auto mean = file.Num1DView<double>(tmp, "mean");
+        auto stdDev = file.Num1DView<double>(tmp, "std_dev", mean.Count);
+        // operator= clones into this->mm
+        if(this->Mean.Value != NULL) {
+            this->Mean.Release();
+            this->StdDev.Release();
+        }
+        this->Mean = mean;
+        this->StdDev = stdDev;
+        this->Samples = 0;
+    }
+};
+
+// StandardScaler for SparseCSR without the centering: x / StdDev keeps every zero a zero.
+// Columns with no variance are left as they are.
+class SparseScaler {
+    public:
+    MemoryManager mm;
+    Num1D<double> StdDev;
+    SparseCSR<double> Data;
+    SparseScaler(SparseCSR<double> data): StdDev(mm), Data(data) {}
+    
+    void Fit() {
+        if(this->StdDev.Value != NULL) {
+            this->StdDev.Release();
+        }
+        auto stdDev = this->Data.StdDev(this->mm, 1);
+        this->StdDev.Count = stdDev.Count;
+        this->StdDev.Value = stdDev.Value;
+    }
+    
+    SparseCSR<double> Transform(MemoryManager& memoryManager) {
+        Num1D<double> n1d(this->mm);
+        auto scale = n1d.Create(this->StdDev.Count);
+        for(int n = 0; n < scale.Count; n += 1) {
+            scale[n] = (this->StdDev[n] > 0) ? 1 / this->StdDev[n] : 1;
+        }
+        auto dst = this->Data.ScaleColumns(memoryManager, scale);
+        scale.Release();
+        return dst;
     }
 };
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+#include "numxd.h"
+
+// Reduced precision storage of a Num2D<double>: 2 bytes per value as IEEE half (fp16) or bfloat16, or 1 byte as
+// int8 scaled per column (value = Offset[n] + Scale[n] * code). Standardized features keep 3 significant digits in
+// fp16 and 2 in bf16/int8, and every pass over the data moves a quarter or an eighth of the bytes.
+// Kernels decode a row on the fly into a local array of D doubles (DispatchDim) with straight-line conversions the
+// compiler vectorizes, then run the same FixedDim code as the double data.
+// Error[i] bounds the Euclidean distance between row i and its decoded copy, so a distance computed on the codes is
+// within Error[i] of the exact one; Source optionally keeps the exact rows (e.g. on a backing store) to settle ties.
+enum QuantFormat {
+    QuantFloat16,
+    QuantBFloat16,
+    QuantInt8,
+};
+
+namespace Quantize {
+    inline float FromBits(uint32_t bits) {
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+    inline uint32_t ToBits(float value) {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    // Round to nearest even, overflow to infinity, NaN stays NaN; subnormals included.
+    inline uint16_t FloatToHalf(float value) {
+        const uint32_t w = ToBits(value);
+        const uint32_t shifted = w + w;
+        const uint32_t sign = w & 0x80000000;
+        uint32_t bias = std::max(shifted & 0xFF000000, 0x71000000u);
+        // scaling by 2^112 then 2^-110 rounds to the half mantissa and saturates to infinity
+        float base = (fabsf(value) * 0x1.0p+112f) * 0x1.0p-110f;
+        base = FromBits((bias >> 1) + 0x07800000) + base;
+        const uint32_t bits = ToBits(base);
+        const uint32_t nonsign = ((bits >> 13) & 0x00007C00) + (bits & 0x00000FFF);
+        return (sign >> 16) | (shifted > 0xFF000000 ? 0x7E00 : nonsign);
+    }
+    // Branch free (one select), so the loops over a row vectorize.
+    inline float HalfToFloat(uint16_t half) {
+        const uint32_t w = (uint32_t)half << 16;
+        const uint32_t sign = w & 0x80000000;
+        const uint32_t twice = w + w;
+        const float normalized = FromBits((twice >> 4) + (0xE0u << 23)) * 0x1.0p-112f;
+        const float denormalized = FromBits((twice >> 17) | (126u << 23)) - 0.5f;
+        return FromBits(sign | (twice < (1u << 27) ? ToBits(denormalized) : ToBits(normalized)));
+    }
+
+    inline uint16_t FloatToBFloat16(float value) {
+        const uint32_t bits = ToBits(value);
+        if(value != value) {
+            return (bits >> 16) | 0x0040;
+        }
+        return (bits + 0x7FFF + ((bits >> 16) & 1)) >> 16;
+    }
+    inline float BFloat16ToFloat(uint16_t value) {
+        return FromBits((uint32_t)value << 16);
+    }
+
+    // Call f(std::integral_constant<int, Format>()) for a QuantFormat known at runtime.
+    template <typename F>
+    auto DispatchFormat(int format, F f) {
+        switch(format) {
+            case QuantFloat16: return f(std::integral_constant<int, QuantFloat16>());
+            case QuantBFloat16: return f(std::integral_constant<int, QuantBFloat16>());
+            case QuantInt8: return f(std::integral_constant<int, QuantInt8>());
+            default: throw Format("error in %s: %d, unknown format %d", __FUNCTION__, __LINE__, format);
+        }
+    }
+
+    inline int Width(int format) {
+        return (format == QuantInt8) ? 1 : 2;
+    }
+};
+
+class Quantized2D {
+    public:
+    long int Row;
+    long int Col;
+    int Format;
+    // Row x Col codes, Quantize::Width(Format) bytes each
+    unsigned char* Codes;
+    // int8 only: value = Offset[n] + Scale[n] * code
+    double* Scale;
+    double* Offset;
+    float* Error;
+    // the exact rows when kept by FromDense, Value NULL otherwise
+    Num2D<double> Source;
+    MemoryManager& mm;
+    Quantized2D(MemoryManager& memoryManager):
+        Row(0), Col(0), Format(QuantFloat16), Codes(NULL), Scale(NULL), Offset(NULL), Error(NULL), Source(memoryManager), mm(memoryManager) {}
+
+    Quantized2D Create(long int row, long int col, int format) {
+        Quantized2D dst(this->mm);
+        dst.Row = row;
+        dst.Col = col;
+        dst.Format = format;
+        dst.Codes = (unsigned char*)this->mm.Alloc(Quantize::Width(format) * std::max(row * col, 1L));
+        dst.Scale = (double*)this->mm.Alloc(sizeof(double) * std::max(col, 1L));
+        dst.Offset = (double*)this->mm.Alloc(sizeof(double) * std::max(col, 1L));
+        dst.Error = (float*)this->mm.Alloc(sizeof(float) * std::max(row, 1L));
+        return dst;
+    }
+    // Source is not owned.
+    void Release() {
+        this->mm.Release(this->Codes);
+        this->mm.Release(this->Scale);
+        this->mm.Release(this->Offset);
+        this->mm.Release(this->Error);
+    }
+    // Bytes of the quantized rows, plus the exact rows when a Source is held.
+    long int Bytes() const {
+        long int bytes = Quantize::Width(this->Format) * this->Row * this->Col + sizeof(float) * this->Row + 2 * sizeof(double) * this->Col;
+        if(this->Source.Value != NULL) {
+            bytes += sizeof(double) * this->Source.Row * this->Source.Col;
+        }
+        return bytes;
+    }
+
+    // Decodes row index into out[Col]; D is Col or Dynamic, as from DispatchDim.
+    template <int Format, int D>
+    void DecodeRow(long int index, double* out) const {
+        const int col = FixedDim<double, D>::Dim(this->Col);
+        if constexpr (Format == QuantInt8) {
+            const int8_t* code = (const int8_t*)this->Codes + index * this->Col;
+            for(int n = 0; n < col; n += 1) {
+                out[n] = this->Offset[n] + this->Scale[n] * code[n];
+            }
+        } else {
+            const uint16_t* code = (const uint16_t*)this->Codes + index * this->Col;
+            for(int n = 0; n < col; n += 1) {
+                out[n] = (Format == QuantFloat16) ? Quantize::HalfToFloat(code[n]) : Quantize::BFloat16ToFloat(code[n]);
+            }
+        }
+    }
+    void DecodeRow(long int index, double* out) const {
+        Quantize::DispatchFormat(this->Format, [&](auto format) {
+            this->DecodeRow<decltype(format)::value, Dynamic>(index, out);
+        });
+    }
+
+    ////////////////////////////////////////
+    // conversion
+    ////////////////////////////////////////
+    // int8 maps [min, max] of every column onto [-127, 127]. keepSource keeps x (not a copy) as Source for rescoring,
+    // which keeps the exact rows alive, so only a caller that wants the near ties settled exactly should ask for it.
+    Quantized2D FromDense(Num2D<double> x, int format, bool keepSource = false) {
+        auto dst = this->Create(x.Row, x.Col, format);
+        for(long int n = 0; n < x.Col; n += 1) {
+            dst.Scale[n] = 1;
+            dst.Offset[n] = 0;
+        }
+        if(format == QuantInt8 && x.Row > 0) {
+            for(long int n = 0; n < x.Col; n += 1) {
+                double low = x[0][n];
+                double high = x[0][n];
+                for(long int m = 1; m < x.Row; m += 1) {
+                    low = std::min(low, x[m][n]);
+                    high = std::max(high, x[m][n]);
+                }
+                dst.Offset[n] = (low + high) / 2;
+                dst.Scale[n] = (high > low) ? (high - low) / 254 : 1;
+            }
+        }
+        Quantize::DispatchFormat(format, [&](auto kind) {
+            const int Format = decltype(kind)::value;
+            Parallel::ParallelFor(0, x.Row, Parallel::MinWork / std::max(1L, x.Col), [&](long int begin, long int end) {
+                std::vector<double> decoded(x.Col);
+                for(long int m = begin; m < end; m += 1) {
+                    for(long int n = 0; n < x.Col; n += 1) {
+                        if constexpr (Format == QuantInt8) {
+                            double code = round((x[m][n] - dst.Offset[n]) / dst.Scale[n]);
+                            ((int8_t*)dst.Codes)[m * x.Col + n] = (int8_t)std::min(127.0, std::max(-127.0, code));
+                        } else if constexpr (Format == QuantFloat16) {
+                            ((uint16_t*)dst.Codes)[m * x.Col + n] = Quantize::FloatToHalf(x[m][n]);
+                        } else {
+                            ((uint16_t*)dst.Codes)[m * x.Col + n] = Quantize::FloatToBFloat16(x[m][n]);
+                        }
+                    }
+                    dst.DecodeRow<Format, Dynamic>(m, decoded.data());
+                    double error = 0;
+                    for(long int n = 0; n < x.Col; n += 1) {
+                        error += (x[m][n] - decoded[n]) * (x[m][n] - decoded[n]);
+                    }
+                    // rounded up, so it stays a bound in float
+                    dst.Error[m] = nextafterf((float)sqrt(error), INFINITY);
+                }
+            });
+        });
+        if(keepSource) {
+            dst.Source.Row = x.Row;
+            dst.Source.Col = x.Col;
+            dst.Source.Value = x.Value;
+        }
+        return dst;
+    }
+
+    Num2D<double> ToDense(MemoryManager& memoryManager) const {
+        Num2D<double> n2d(memoryManager);
+        auto dst = n2d.Create(this->Row, this->Col);
+        for(long int m = 0; m < this->Row; m += 1) {
+            this->DecodeRow(m, dst[m]);
+        }
+        return dst;
+    }
+
+    ////////////////////////////////////////
+    // column statistics
+    ////////////////////////////////////////
+    // Decoded Reduction::Block rows at a time into a dense buffer the engine reduces, the blocks over the thread pool,
+    // and the block totals combined in block order with KahanAdd, as IndexView2D::Total does.
+    Num1D<double> Total(MemoryManager& memoryManager) const {
+        const long int blocks = (this->Row + Reduction::Block - 1) / Reduction::Block;
+        std::vector<double> parts(std::max(1L, blocks * this->Col));
+        Quantize::DispatchFormat(this->Format, [&](auto format) {
+            DispatchDim(this->Col, [&](auto dim) {
+                const int D = decltype(dim)::value;
+                Parallel::ParallelFor(0, blocks, std::max(1L, Parallel::MinWork / std::max(1L, Reduction::Block * this->Col)), [&](long int begin, long int end) {
+                    std::vector<double> buffer(Reduction::Block * this->Col);
+                    for(long int b = begin; b < end; b += 1) {
+                        const long int m0 = b * Reduction::Block;
+                        const long int rows = std::min(Reduction::Block, this->Row - m0);
+                        for(long int m = 0; m < rows; m += 1) {
+                            this->DecodeRow<decltype(format)::value, D>(m0 + m, buffer.data() + m * this->Col);
+                        }
+                        Reduction::Reduce(Reduction::Lines<double>(buffer.data(), this->Col, rows, 1, this->Col), ReduceSum, 1, parts.data() + b * this->Col, (long int*)NULL);
+                    }
+                });
+            });
+        });
+        Num1D<double> n1d(memoryManager);
+        auto dst = n1d.Zeros(this->Col);
+        std::vector<double> comp(this->Col, 0);
+        for(long int b = 0; b < blocks; b += 1) {
+            for(long int n = 0; n < this->Col; n += 1) {
+                Reduction::KahanAdd(dst[n], comp[n], parts[b * this->Col + n]);
+            }
+        }
+        return dst;
+    }
+    Num1D<double> Mean(MemoryManager& memoryManager) const {
+        auto dst = this->Total(memoryManager);
+        for(long int n = 0; n < this->Col; n += 1) {
+            dst[n] /= this->Row;
+        }
+        return dst;
+    }
+};
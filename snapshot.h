@@ -0,0 +1,233 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <memory>
+
+#include "numxd.h"
+
+// Binary snapshot of trained model state.
+// A file is a 64 byte header, a table of named sections and the section data, each section aligned to 64 bytes
+// so it can be used in place from a read-only mapping. Everything is little-endian; the checksum (FNV-1a 64)
+// covers every byte after the header.
+//   header:  "NUMXDSNP", uint32 version, uint32 kind, uint32 sections, uint32 reserved, uint64 file size, uint64 checksum
+//   section: char name[16], int64 row, int32 col, uint32 element size, uint64 offset
+namespace Snapshot {
+    const char Magic[8] = {'N', 'U', 'M', 'X', 'D', 'S', 'N', 'P'};
+    const uint32_t Version = 1;
+    const size_t HeaderSize = 64;
+    const size_t EntrySize = 40;
+    const size_t Align = 64;
+
+    enum Kind {
+        KindKMeans = 1,
+        KindStandardScaler = 2,
+    };
+
+    uint64_t Checksum(const char* data, size_t size) {
+        uint64_t hash = 14695981039346656037ULL;
+        for(size_t i = 0; i < size; i += 1) {
+            hash ^= (uint8_t)data[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    // Whether elementSize * row * col <= limit, without overflowing.
+    bool Fits(uint64_t elementSize, uint64_t row, uint64_t col, uint64_t limit) {
+        if(elementSize == 0 || row == 0 || col == 0) {
+            return true;
+        }
+        return row <= limit / elementSize && col <= limit / elementSize / row;
+    }
+
+    class Section {
+        public:
+        std::string Name;
+        long int Row;
+        int Col;
+        int ElementSize;
+        const char* Data;
+        Section(): Row(0), Col(0), ElementSize(0), Data(NULL) {}
+    };
+
+    ////////////////////////////////////////
+    // write
+    ////////////////////////////////////////
+    class Writer {
+        public:
+        uint32_t Kind;
+        std::vector<Section> Sections;
+        Writer(uint32_t kind): Kind(kind) {}
+
+        // The data is not copied, it has to stay valid until Save.
+        template <typename T>
+        void Add(const char* name, const T* value, long int row, int col) {
+            if(strlen(name) >= 16) {
+                throw Format("error in %s: %d, section name %s is too long", __FUNCTION__, __LINE__, name);
+            }
+            Section section;
+            section.Name = name;
+            section.Row = row;
+            section.Col = col;
+            section.ElementSize = sizeof(T);
+            section.Data = (const char*)value;
+            this->Sections.push_back(section);
+        }
+        template <typename T, int Layout>
+        void Add(const char* name, Num2D<T, Layout> x) {
+            static_assert(Layout == RowMajor, "snapshot sections are RowMajor");
+            this->Add(name, x.Value, x.Row, x.Col);
+        }
+        template <typename T>
+        void Add(const char* name, Num1D<T> x) {
+            this->Add(name, x.Value, x.Count, 1);
+        }
+
+        int Save(const char* fileName) {
+            if(!IsLittleEndian()) {
+                return -1;
+            }
+            size_t offset = (HeaderSize + EntrySize * this->Sections.size() + Align - 1) / Align * Align;
+            std::vector<uint64_t> offsets;
+            for(auto section = this->Sections.begin(); section != this->Sections.end(); section++) {
+                offsets.push_back(offset);
+                offset += (section->ElementSize * section->Row * section->Col + Align - 1) / Align * Align;
+            }
+            std::string buffer(offset, '\0');
+            char* p = &buffer[HeaderSize];
+            for(unsigned int i = 0; i < this->Sections.size(); i++) {
+                const Section& section = this->Sections[i];
+                int64_t row = section.Row;
+                int32_t col = section.Col;
+                uint32_t elementSize = section.ElementSize;
+                memcpy(p, section.Name.c_str(), section.Name.size());
+                memcpy(p + 16, &row, 8);
+                memcpy(p + 24, &col, 4);
+                memcpy(p + 28, &elementSize, 4);
+                memcpy(p + 32, &offsets[i], 8);
+                p += EntrySize;
+                memcpy(&buffer[offsets[i]], section.Data, (size_t)section.ElementSize * section.Row * section.Col);
+            }
+
+            uint32_t count = this->Sections.size();
+            uint32_t reserved = 0;
+            uint64_t size = buffer.size();
+            uint64_t checksum = Checksum(buffer.data() + HeaderSize, buffer.size() - HeaderSize);
+            memcpy(&buffer[0], Magic, 8);
+            memcpy(&buffer[8], &Version, 4);
+            memcpy(&buffer[12], &this->Kind, 4);
+            memcpy(&buffer[16], &count, 4);
+            memcpy(&buffer[20], &reserved, 4);
+            memcpy(&buffer[24], &size, 8);
+            memcpy(&buffer[32], &checksum, 8);
+
+            FILE* fp = fopen(fileName, "wb");
+            if(fp == NULL) {
+                return -1;
+            }
+            int result = 0;
+            if(fwrite(buffer.data(), 1, buffer.size(), fp) != buffer.size()) {
+                result = -1;
+            }
+            if(fclose(fp) != 0) {
+                result = -1;
+            }
+            return result;
+        }
+    };
+
+    ////////////////////////////////////////
+    // read
+    ////////////////////////////////////////
+    // A read-only mapping of a snapshot; sections point into the mapping and live as long as this object.
+    class File {
+        public:
+        MappedFile Map;
+        uint32_t Kind;
+        std::vector<Section> Sections;
+        File(const char* fileName, uint32_t kind, bool verify = true): Map(fileName), Kind(0) {
+            const char* data = this->Map.Data;
+            if(this->Map.Size < HeaderSize || memcmp(data, Magic, 8) != 0) {
+                throw Format("error in %s: %d, %s is not a snapshot", __FUNCTION__, __LINE__, fileName);
+            }
+            uint32_t version, count;
+            uint64_t size, checksum;
+            memcpy(&version, data + 8, 4);
+            memcpy(&this->Kind, data + 12, 4);
+            memcpy(&count, data + 16, 4);
+            memcpy(&size, data + 24, 8);
+            memcpy(&checksum, data + 32, 8);
+            if(version != Version) {
+                throw Format("error in %s: %d, unsupported snapshot version %d", __FUNCTION__, __LINE__, (int)version);
+            }
+            if(this->Kind != kind) {
+                throw Format("error in %s: %d, snapshot kind %d, expected %d", __FUNCTION__, __LINE__, (int)this->Kind, (int)kind);
+            }
+            if(size != this->Map.Size || HeaderSize + EntrySize * count > size) {
+                throw Format("error in %s: %d, snapshot is truncated", __FUNCTION__, __LINE__);
+            }
+            if(verify && Checksum(data + HeaderSize, size - HeaderSize) != checksum) {
+                throw Format("error in %s: %d, snapshot checksum mismatch", __FUNCTION__, __LINE__);
+            }
+
+            const char* p = data + HeaderSize;
+            for(uint32_t i = 0; i < count; i++) {
+                int64_t row;
+                int32_t col;
+                uint32_t elementSize;
+                uint64_t offset;
+                memcpy(&row, p + 16, 8);
+                memcpy(&col, p + 24, 4);
+                memcpy(&elementSize, p + 28, 4);
+                memcpy(&offset, p + 32, 8);
+                if(row < 0 || col < 0 || offset % Align != 0) {
+                    throw Format("error in %s: %d, snapshot section %d is malformed", __FUNCTION__, __LINE__, (int)i);
+                }
+                if(offset > size || !Fits(elementSize, row, col, size - offset)) {
+                    throw Format("error in %s: %d, snapshot section %d is truncated", __FUNCTION__, __LINE__, (int)i);
+                }
+                Section section;
+                section.Name = std::string(p, strnlen(p, 16));
+                section.Row = row;
+                section.Col = col;
+                section.ElementSize = elementSize;
+                section.Data = data + offset;
+                this->Sections.push_back(section);
+                p += EntrySize;
+            }
+        }
+        File(const File&) = delete;
+        File& operator=(const File&) = delete;
+
+        // The named section as row x col elements of T, -1 accepts any size.
+        template <typename T>
+        const Section& Get(const char* name, long int row = -1, int col = -1) {
+            for(auto section = this->Sections.begin(); section != this->Sections.end(); section++) {
+                if(section->Name != name) {
+                    continue;
+                }
+                if(section->ElementSize != sizeof(T)) {
+                    throw Format("error in %s: %d, section %s has %d byte elements, expected %d", __FUNCTION__, __LINE__, name, section->ElementSize, (int)sizeof(T));
+                }
+                if((row >= 0 && section->Row != row) || (col >= 0 && section->Col != col)) {
+                    throw Format("error in %s: %d, section %s is (%ld, %d), expected (%ld, %d)", __FUNCTION__, __LINE__, name, section->Row, section->Col, row, col);
+                }
+                return *section;
+            }
+            throw Format("error in %s: %d, snapshot has no section %s", __FUNCTION__, __LINE__, name);
+        }
+
+        // Views straight into the mapping; they must not be written or released.
+        template <typename T>
+        Num2D<T> Num2DView(MemoryManager& mm, const char* name, long int row = -1, int col = -1) {
+            auto section = this->Get<T>(name, row, col);
+            return Num2D<T>(mm, section.Row, section.Col, (T*)section.Data);
+        }
+        template <typename T>
+        Num1D<T> Num1DView(MemoryManager& mm, const char* name, long int count = -1) {
+            auto section = this->Get<T>(name, count, 1);
+            return Num1D<T>(mm, section.Row, (T*)section.Data);
+        }
+    };
+};
@@ -0,0 +1,308 @@
+#pragma once
+
+#include "numxd.h"
+#include "tsv.h"
+
+// Compressed sparse row matrix: the non-zeros of row m are Value[RowPtr[m] .. RowPtr[m + 1]) at columns
+// ColIndex[...], sorted by column. The three arrays live in a MemoryManager like Num2D's Value.
+// Rows and non-zeros are counted in 64 bits; column indexes stay 32-bit, half the index bytes of every product.
+template <typename T>
+class SparseRow {
+    public:
+    int Count;
+    const int* Index;
+    const T* Value;
+    SparseRow(int count, const int* index, const T* value): Count(count), Index(index), Value(value) {}
+
+    T Dot(const T* dense) const {
+        T total = 0;
+        for(int i = 0; i < this->Count; i += 1) {
+            total += this->Value[i] * dense[this->Index[i]];
+        }
+        return total;
+    }
+    T SquaredNorm() const {
+        T total = 0;
+        for(int i = 0; i < this->Count; i += 1) {
+            total += this->Value[i] * this->Value[i];
+        }
+        return total;
+    }
+    // dense += scale * row
+    void AddTo(T* dense, T scale = 1) const {
+        for(int i = 0; i < this->Count; i += 1) {
+            dense[this->Index[i]] += scale * this->Value[i];
+        }
+    }
+};
+
+template <typename T>
+class SparseCSR {
+    public:
+    long int Row;
+    long int Col;
+    long int Nnz;
+    long int* RowPtr;
+    int* ColIndex;
+    T* Value;
+    MemoryManager& mm;
+    SparseCSR(MemoryManager& memoryManager): Row(0), Col(0), Nnz(0), RowPtr(NULL), ColIndex(NULL), Value(NULL), mm(memoryManager) {}
+
+    SparseCSR Create(long int row, long int col, long int nnz) {
+        SparseCSR dst(this->mm);
+        dst.Row = row;
+        dst.Col = col;
+        dst.Nnz = nnz;
+        dst.RowPtr = (long int*)this->mm.Alloc(sizeof(long int) * (row + 1));
+        dst.ColIndex = (int*)this->mm.Alloc(sizeof(int) * std::max(nnz, 1L));
+        dst.Value = (T*)this->mm.Alloc(sizeof(T) * std::max(nnz, 1L));
+        return dst;
+    }
+    void Release() {
+        this->mm.Release(this->RowPtr);
+        this->mm.Release(this->ColIndex);
+        this->mm.Release(this->Value);
+    }
+    SparseCSR Clone(const SparseCSR& src) {
+        auto dst = this->Create(src.Row, src.Col, src.Nnz);
+        memcpy(dst.RowPtr, src.RowPtr, sizeof(long int) * (src.Row + 1));
+        memcpy(dst.ColIndex, src.ColIndex, sizeof(int) * src.Nnz);
+        memcpy(dst.Value, src.Value, sizeof(T) * src.Nnz);
+        return dst;
+    }
+    SparseCSR Clone() {
+        return this->Clone(*this);
+    }
+
+    SparseRow<T> operator[](long int index) const {
+        NUMXD_CHECK_INDEX(index, this->Row);
+        long int begin = this->RowPtr[index];
+        return SparseRow<T>(this->RowPtr[index + 1] - begin, this->ColIndex + begin, this->Value + begin);
+    }
+    double Density() {
+        return (this->Row > 0 && this->Col > 0) ? (double)this->Nnz / ((double)this->Row * this->Col) : 0;
+    }
+
+    ////////////////////////////////////////
+    // construction
+    ////////////////////////////////////////
+    SparseCSR FromDense(Num2D<T> x) {
+        long int nnz = 0;
+        for(long int i = 0; i < x.Row * x.Col; i += 1) {
+            nnz += (x.Value[i] != 0);
+        }
+        auto dst = this->Create(x.Row, x.Col, nnz);
+        long int k = 0;
+        for(long int m = 0; m < x.Row; m += 1) {
+            dst.RowPtr[m] = k;
+            for(long int n = 0; n < x.Col; n += 1) {
+                if(x[m][n] != 0) {
+                    dst.ColIndex[k] = n;
+                    dst.Value[k] = x[m][n];
+                    k += 1;
+                }
+            }
+        }
+        dst.RowPtr[x.Row] = k;
+        return dst;
+    }
+
+    // (rows[i], cols[i], values[i]) in any order; duplicates are summed.
+    SparseCSR FromTriplets(long int row, long int col, const std::vector<long int>& rows, const std::vector<int>& cols, const std::vector<T>& values) {
+        std::vector<long int> order(rows.size());
+        for(size_t i = 0; i < order.size(); i++) {
+            if(rows[i] < 0 || rows[i] >= row || cols[i] < 0 || cols[i] >= col) {
+                throw Format("error in %s: %d, triplet (%ld, %d) is out of (%ld, %ld)", __FUNCTION__, __LINE__, rows[i], cols[i], row, col);
+            }
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](long int a, long int b) {
+            return (rows[a] != rows[b]) ? rows[a] < rows[b] : cols[a] < cols[b];
+        });
+        long int nnz = 0;
+        for(size_t i = 0; i < order.size(); i++) {
+            if(i == 0 || rows[order[i]] != rows[order[i - 1]] || cols[order[i]] != cols[order[i - 1]]) {
+                nnz += 1;
+            }
+        }
+        auto dst = this->Create(row, col, nnz);
+        memset(dst.RowPtr, 0, sizeof(long int) * (row + 1));
+        long int k = -1;
+        for(size_t i = 0; i < order.size(); i++) {
+            long int o = order[i];
+            if(i == 0 || rows[o] != rows[order[i - 1]] || cols[o] != cols[order[i - 1]]) {
+                k += 1;
+                dst.ColIndex[k] = cols[o];
+                dst.Value[k] = 0;
+                dst.RowPtr[rows[o] + 1] += 1;
+            }
+            dst.Value[k] += values[o];
+        }
+        for(long int m = 0; m < row; m += 1) {
+            dst.RowPtr[m + 1] += dst.RowPtr[m];
+        }
+        return dst;
+    }
+
+    Num2D<T> ToDense(MemoryManager& memoryManager) {
+        Num2D<T> n2d(memoryManager);
+        auto dst = n2d.Create(this->Row, this->Col);
+        memset(dst.Value, 0, sizeof(T) * dst.Row * dst.Col);
+        for(long int m = 0; m < this->Row; m += 1) {
+            (*this)[m].AddTo(dst[m]);
+        }
+        return dst;
+    }
+
+    // Rows of indexes as a dense matrix, e.g. initial centroids.
+    Num2D<T> Indexing(MemoryManager& memoryManager, Num1D<long int> indexes) {
+        Num2D<T> n2d(memoryManager);
+        auto dst = n2d.Create(indexes.Count, this->Col);
+        memset(dst.Value, 0, sizeof(T) * dst.Row * dst.Col);
+        for(long int i = 0; i < indexes.Count; i += 1) {
+            (*this)[indexes[i]].AddTo(dst[i]);
+        }
+        return dst;
+    }
+
+    ////////////////////////////////////////
+    // column statistics
+    ////////////////////////////////////////
+    // All of them count the implicit zeros, so they agree with the same statistics of ToDense().
+    Num1D<long int> ColumnNnz(MemoryManager& memoryManager) {
+        Num1D<long int> n1d(memoryManager);
+        auto dst = n1d.Create(this->Col);
+        memset(dst.Value, 0, sizeof(long int) * this->Col);
+        for(long int k = 0; k < this->Nnz; k += 1) {
+            dst[this->ColIndex[k]] += 1;
+        }
+        return dst;
+    }
+    Num1D<T> Total(MemoryManager& memoryManager) {
+        Num1D<T> n1d(memoryManager);
+        auto dst = n1d.Create(this->Col);
+        memset(dst.Value, 0, sizeof(T) * this->Col);
+        for(long int k = 0; k < this->Nnz; k += 1) {
+            dst[this->ColIndex[k]] += this->Value[k];
+        }
+        return dst;
+    }
+    Num1D<T> Mean(MemoryManager& memoryManager) {
+        auto dst = this->Total(memoryManager);
+        for(long int n = 0; n < this->Col; n += 1) {
+            dst[n] /= this->Row;
+        }
+        return dst;
+    }
+    // sum((x - mean)^2) over the stored values plus mean^2 for every implicit zero, divided by Row - ddof;
+    // ddof defaults to 1 like Num2D::Variance.
+    Num1D<T> Variance(MemoryManager& memoryManager, double ddof = 1) {
+        auto mean = this->Mean(memoryManager);
+        auto nnz = this->ColumnNnz(memoryManager);
+        Num1D<T> n1d(memoryManager);
+        auto dst = n1d.Create(this->Col);
+        for(long int n = 0; n < this->Col; n += 1) {
+            dst[n] = (this->Row - nnz[n]) * mean[n] * mean[n];
+        }
+        for(long int k = 0; k < this->Nnz; k += 1) {
+            T d = this->Value[k] - mean[this->ColIndex[k]];
+            dst[this->ColIndex[k]] += d * d;
+        }
+        for(long int n = 0; n < this->Col; n += 1) {
+            dst[n] /= (this->Row - ddof);
+        }
+        mean.Release();
+        nnz.Release();
+        return dst;
+    }
+    Num1D<T> StdDev(MemoryManager& memoryManager, double ddof = 1) {
+        auto dst = this->Variance(memoryManager, ddof);
+        for(long int n = 0; n < this->Col; n += 1) {
+            dst[n] = sqrt(dst[n]);
+        }
+        return dst;
+    }
+    Num1D<T> RowSquaredNorms(MemoryManager& memoryManager) {
+        Num1D<T> n1d(memoryManager);
+        auto dst = n1d.Create(this->Row);
+        for(long int m = 0; m < this->Row; m += 1) {
+            dst[m] = (*this)[m].SquaredNorm();
+        }
+        return dst;
+    }
+
+    ////////////////////////////////////////
+    // scaling
+    ////////////////////////////////////////
+    // Column n multiplied by scale[n]; zeros stay zeros, so the sparsity is kept (no centering).
+    SparseCSR ScaleColumns(Num1D<T> scale) {
+        return this->ScaleColumns(this->mm, scale);
+    }
+    SparseCSR ScaleColumns(MemoryManager& memoryManager, Num1D<T> scale) {
+        if(CheckLevel >= 1 && scale.Count != this->Col) {
+            throw Format("error in %s: %d, different SparseCSR::Col %ld != %ld", __FUNCTION__, __LINE__, this->Col, scale.Count);
+        }
+        SparseCSR csr(memoryManager);
+        auto dst = csr.Clone(*this);
+        for(long int k = 0; k < dst.Nnz; k += 1) {
+            dst.Value[k] *= scale[dst.ColIndex[k]];
+        }
+        return dst;
+    }
+};
+
+namespace Sparse {
+    // A TSV of numbers straight into CSR, without the dense Row x Col intermediate.
+    SparseCSR<double> ReadTSV(MemoryManager& mm, const char* fileName, char delimiter = '\t') {
+        MappedFile file(fileName);
+        file.Advise(MADV_SEQUENTIAL);
+        const char* p = file.Data;
+        const char* end = file.Data + file.Size;
+        std::vector<long int> rowPtr(1, 0);
+        std::vector<int> colIndex;
+        std::vector<double> value;
+        long int cols = -1;
+        while(p < end) {
+            const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+            if(lineEnd == NULL) {
+                lineEnd = end;
+            }
+            if(lineEnd != p) {
+                long int n = 0;
+                const char* cell = p;
+                while(cell < lineEnd) {
+                    const char* cellEnd = (const char*)memchr(cell, delimiter, lineEnd - cell);
+                    if(cellEnd == NULL) {
+                        cellEnd = lineEnd;
+                    }
+                    double x;
+                    if(TSV::ParseCell(cell, cellEnd, &x) == NULL) {
+                        throw Format("error in %s: %d, %s parse failed at row %ld", __FUNCTION__, __LINE__, fileName, (long int)rowPtr.size() - 1);
+                    }
+                    if(x != 0) {
+                        colIndex.push_back(n);
+                        value.push_back(x);
+                    }
+                    n += 1;
+                    cell = cellEnd + 1;
+                }
+                if(cols < 0) {
+                    cols = n;
+                } else if(cols != n) {
+                    throw Format("error in %s: %d, different column size at row %ld", __FUNCTION__, __LINE__, (long int)rowPtr.size() - 1);
+                }
+                rowPtr.push_back(colIndex.size());
+            }
+            p = lineEnd + 1;
+        }
+        if(cols < 0) {
+            throw Format("error in %s: %d, %s has no rows.", __FUNCTION__, __LINE__, fileName);
+        }
+        SparseCSR<double> csr(mm);
+        auto dst = csr.Create(rowPtr.size() - 1, cols, value.size());
+        memcpy(dst.RowPtr, rowPtr.data(), sizeof(long int) * rowPtr.size());
+        memcpy(dst.ColIndex, colIndex.data(), sizeof(int) * colIndex.size());
+        memcpy(dst.Value, value.data(), sizeof(double) * value.size());
+        return dst;
+    }
+};
@@ -1,4 +1,12 @@
 
+#pragma once
+
+#include <stdio.h>
+
+#include <charconv>
+#include <future>
+#include <thread>
+
 #include "numxd.h"
 
 namespace TSV {
@@ -37,55 +45,113 @@ namespace TSV {
             if(columns == 0) {
                 columns = m->size();
             } else if(columns != m->size()) {
-                throw Format("error in %s: %d, different column size %d != %d", __FUNCTION__, __LINE__, columns, m->size());
+                throw Format("error in %s: %d, different column size %lu != %lu", __FUNCTION__, __LINE__, columns, m->size());
             }
         }
         
         return rows;
     }
     
+    ////////////////////////////////////////
+    // write
+    ////////////////////////////////////////
+    // precision >= 0 writes scientific notation with that many digits, precision < 0 the shortest round-trip form.
+    // Integer types are always written as plain integers.
     template <typename T>
-    int Write(const char* fileName, Num2D<T> x) {
-        std::ofstream ofs(fileName, std::ios::binary);
-        if(ofs.fail()) {
-            DPRT();
-            return -1;
+    size_t MaxCellSize(int precision) {
+        return 32 + (std::is_floating_point<T>::value && precision > 0 ? precision : 0);
+    }
+    
+    template <typename T>
+    char* FormatCell(char* p, char* end, T value, int precision) {
+        std::to_chars_result result;
+        if constexpr (std::is_floating_point<T>::value) {
+            if(precision < 0) {
+                result = std::to_chars(p, end, value);
+            } else {
+                result = std::to_chars(p, end, value, std::chars_format::scientific, precision);
+            }
+        } else {
+            result = std::to_chars(p, end, value);
         }
-        
-        for(int m = 0; m < x.Row; m += 1) {
-            for(int n= 0; n < x.Col; n += 1) {
-                //ofs << x[m][n];
-                ofs << std::scientific << std::setprecision(15) << x[m][n];
+        return result.ptr;
+    }
+    
+    // Format rows [begin, end) of x into out and return the used length.
+    template <typename T>
+    size_t FormatRows(std::vector<char>& out, Num2D<T> x, long int begin, long int end, int precision) {
+        const size_t rowSize = (MaxCellSize<T>(precision) + 1) * x.Col + 1;
+        out.resize(rowSize * (end - begin));
+        char* p = out.data();
+        char* last = out.data() + out.size();
+        for(long int m = begin; m < end; m += 1) {
+            for(long int n = 0; n < x.Col; n += 1) {
+                p = FormatCell(p, last, x[m][n], precision);
                 if(n < (x.Col - 1)) {
-                    ofs << "\t";
+                    *p++ = '\t';
                 }
             }
-            ofs << "\n";
+            *p++ = '\n';
         }
-        return 0;
+        return p - out.data();
     }
     
+    // Rows are formatted in blocks into user-space buffers and written with one bulk fwrite per block.
+    // With threads > 1 the pool formats one block per thread and the blocks are written in order.
+    // threads <= 0 uses Parallel::Threads(); a file of a single block is always formatted inline.
     template <typename T>
-    int Write(const char* fileName, Num1D<T> x) {
-        std::ofstream ofs(fileName, std::ios::binary);
-        if(ofs.fail()) {
+    int Write(const char* fileName, Num2D<T> x, int precision = 15, int threads = 0) {
+        const long int blockRows = std::max(1L, (long int)((4 << 20) / ((MaxCellSize<T>(precision) + 1) * std::max(1L, x.Col) + 1)));
+        FILE* fp = fopen(fileName, "wb");
+        if(fp == NULL) {
+            DPRT();
             return -1;
         }
+        setvbuf(fp, NULL, _IONBF, 0);
         
-        for(int i = 0; i < x.Count; i += 1) {
-            ofs << std::scientific << std::setprecision(15) << x[i];
-            if(i < (x.Count - 1)) {
-                ofs << "\n";
+        if(threads <= 0) {
+            threads = Parallel::Threads();
+        }
+        threads = (int)std::max(1L, std::min((long int)threads, (x.Row + blockRows - 1) / blockRows));
+        std::vector<std::vector<char>> buffers(threads);
+        std::vector<size_t> used(threads);
+        int result = 0;
+        for(long int m = 0; m < x.Row && result == 0; m += blockRows * threads) {
+            if(threads == 1) {
+                used[0] = FormatRows(buffers[0], x, m, std::min(x.Row, m + blockRows), precision);
+            } else {
+                Parallel::ParallelFor(0, threads, 1, [&](long int first, long int last) {
+                    for(long int i = first; i < last; i += 1) {
+                        long int begin = std::min(x.Row, m + blockRows * i);
+                        long int end = std::min(x.Row, begin + blockRows);
+                        used[i] = FormatRows(buffers[i], x, begin, end, precision);
+                    }
+                }, threads);
+            }
+            for(int i = 0; i < threads; i += 1) {
+                if(used[i] > 0 && fwrite(buffers[i].data(), 1, used[i], fp) != used[i]) {
+                    result = -1;
+                    break;
+                }
+                used[i] = 0;
             }
         }
-        ofs << "\n";
-        return 0;
+        if(fclose(fp) != 0) {
+            result = -1;
+        }
+        return result;
+    }
+    
+    template <typename T>
+    int Write(const char* fileName, Num1D<T> x, int precision = 15, int threads = 0) {
+        Num2D<T> column(x.mm, x.Count, 1, x.Value);
+        return Write(fileName, column, precision, threads);
     }
     
     Num2D<double> ToDouble(MemoryManager& mm, Buffer buffer) {
         Num2D<double> n2d(mm);
-        const int Row = buffer.size();
-        const int Col = buffer[0].size();
+        const long int Row = buffer.size();
+        const long int Col = buffer[0].size();
         auto dst = n2d.Create(Row, Col);
         for(auto row = buffer.begin(); row != buffer.end(); row++) {
             auto m = std::distance(buffer.begin(), row);
@@ -96,4 +162,328 @@ namespace TSV {
         }
         return dst;
     }
+    
+    ////////////////////////////////////////
+    // parallel read
+    ////////////////////////////////////////
+    class Chunk {
+        public:
+        const char* Begin;
+        const char* End;
+        long int Rows;
+        long int Cols;
+        long int RowOffset;
+        long int ErrorRow;
+        Chunk(const char* begin, const char* end): Begin(begin), End(end), Rows(0), Cols(0), RowOffset(0), ErrorRow(-1) {}
+    };
+    
+    const char* ParseCell(const char* p, const char* end, double* value) {
+        while(p < end && *p == ' ') {
+            p++;
+        }
+        if(p < end && *p == '+') {
+            p++;
+        }
+        auto result = std::from_chars(p, end, *value);
+        if(result.ec != std::errc()) {
+            return NULL;
+        }
+        return result.ptr;
+    }
+    
+    // Pass 1: count non-empty rows and check that every row has the same number of cells.
+    void CountChunk(Chunk* chunk, char delimiter) {
+        const char* p = chunk->Begin;
+        while(p < chunk->End) {
+            const char* lineEnd = (const char*)memchr(p, '\n', chunk->End - p);
+            if(lineEnd == NULL) {
+                lineEnd = chunk->End;
+            }
+            if(lineEnd != p) {
+                long int cols = 0;
+                const char* cell = p;
+                while(cell < lineEnd) {
+                    const char* cellEnd = (const char*)memchr(cell, delimiter, lineEnd - cell);
+                    cols += 1;
+                    cell = (cellEnd == NULL) ? lineEnd : cellEnd + 1;
+                }
+                if(chunk->Cols == 0) {
+                    chunk->Cols = cols;
+                } else if(chunk->Cols != cols && chunk->ErrorRow < 0) {
+                    chunk->ErrorRow = chunk->Rows;
+                }
+                chunk->Rows += 1;
+            }
+            p = lineEnd + 1;
+        }
+    }
+    
+    // Pass 2: parse the chunk into its own rows of dst.
+    void ParseChunk(Chunk* chunk, Num2D<double> dst, char delimiter) {
+        const char* p = chunk->Begin;
+        long int m = chunk->RowOffset;
+        while(p < chunk->End) {
+            const char* lineEnd = (const char*)memchr(p, '\n', chunk->End - p);
+            if(lineEnd == NULL) {
+                lineEnd = chunk->End;
+            }
+            if(lineEnd != p) {
+                const char* cell = p;
+                for(long int n = 0; n < dst.Col; n += 1) {
+                    const char* cellEnd = (const char*)memchr(cell, delimiter, lineEnd - cell);
+                    if(cellEnd == NULL) {
+                        cellEnd = lineEnd;
+                    }
+                    if(ParseCell(cell, cellEnd, &dst[m][n]) == NULL) {
+                        chunk->ErrorRow = m - chunk->RowOffset;
+                        return;
+                    }
+                    cell = cellEnd + 1;
+                }
+                m += 1;
+            }
+            p = lineEnd + 1;
+        }
+    }
+    
+    // Split the file at newline boundaries and parse the chunks on the shared thread pool.
+    // threads <= 0 uses Parallel::Threads().
+    Num2D<double> ReadParallel(MemoryManager& mm, const char* fileName, int threads = 0, char delimiter = '\t') {
+        const size_t minChunkSize = 1 << 20;
+        MappedFile file(fileName);
+        file.Advise(MADV_SEQUENTIAL);
+        const char* text = file.Data;
+        const char* textEnd = file.Data + file.Size;
+        
+        if(threads <= 0) {
+            threads = Parallel::Threads();
+        }
+        threads = std::max(1, std::min(threads, (int)(file.Size / minChunkSize) + 1));
+        
+        std::vector<Chunk> chunks;
+        const char* begin = text;
+        for(int i = 0; i < threads && begin < textEnd; i += 1) {
+            const char* end = (i == threads - 1) ? textEnd : text + file.Size / threads * (i + 1);
+            if(end < begin) {
+                end = begin;
+            }
+            const char* newline = (const char*)memchr(end, '\n', textEnd - end);
+            end = (newline == NULL) ? textEnd : newline + 1;
+            chunks.push_back(Chunk(begin, end));
+            begin = end;
+        }
+        
+        Parallel::ParallelFor(0, chunks.size(), 1, [&](long int begin, long int end) {
+            for(long int i = begin; i < end; i += 1) {
+                CountChunk(&chunks[i], delimiter);
+            }
+        }, threads);
+        
+        // prefix sum of the row counts gives each chunk its first output row
+        long int rows = 0;
+        long int cols = 0;
+        for(auto chunk = chunks.begin(); chunk != chunks.end(); chunk++) {
+            if(chunk->ErrorRow >= 0) {
+                throw Format("error in %s: %d, different column size at row %ld", __FUNCTION__, __LINE__, rows + chunk->ErrorRow);
+            }
+            if(chunk->Rows == 0) {
+                continue;
+            }
+            if(cols == 0) {
+                cols = chunk->Cols;
+            } else if(cols != chunk->Cols) {
+                throw Format("error in %s: %d, different column size %ld != %ld", __FUNCTION__, __LINE__, cols, chunk->Cols);
+            }
+            chunk->RowOffset = rows;
+            rows += chunk->Rows;
+        }
+        if(rows == 0) {
+            throw Format("error in %s: %d, %s has no rows.", __FUNCTION__, __LINE__, fileName);
+        }
+        
+        Num2D<double> n2d(mm);
+        auto dst = n2d.Create(rows, cols);
+        Parallel::ParallelFor(0, chunks.size(), 1, [&](long int begin, long int end) {
+            for(long int i = begin; i < end; i += 1) {
+                ParseChunk(&chunks[i], dst, delimiter);
+            }
+        }, threads);
+        for(auto chunk = chunks.begin(); chunk != chunks.end(); chunk++) {
+            if(chunk->ErrorRow >= 0) {
+                dst.Release();
+                throw Format("error in %s: %d, %s parse failed at row %ld", __FUNCTION__, __LINE__, fileName, chunk->RowOffset + chunk->ErrorRow);
+            }
+        }
+        return dst;
+    }
+    
+    ////////////////////////////////////////
+    // streaming read
+    ////////////////////////////////////////
+    // Pull-based reader that yields fixed-size row batches from a file, or from stdin when fileName is NULL or "-".
+    // Memory stays constant: the batches live in one buffer (two with readAhead, the next one
+    // being parsed on a background thread), so a returned batch is only valid until the next call of Next().
+    class BatchReader {
+        public:
+        MemoryManager& mm;
+        FILE* File;
+        bool OwnFile;
+        char Delimiter;
+        long int BatchRows;
+        long int Cols;
+        long int RowsRead;
+        bool ReadAhead;
+        char* Line;
+        size_t LineSize;
+        Num2D<double> Buffer[2];
+        int Current;
+        std::future<long int> Pending;
+        
+        BatchReader(MemoryManager& memoryManager, const char* fileName, long int batchRows, bool readAhead = false, char delimiter = '\t'):
+            mm(memoryManager),
+            File(NULL),
+            OwnFile(false),
+            Delimiter(delimiter),
+            BatchRows(batchRows),
+            Cols(0),
+            RowsRead(0),
+            ReadAhead(readAhead),
+            Line(NULL),
+            LineSize(0),
+            Buffer{Num2D<double>(memoryManager), Num2D<double>(memoryManager)},
+            Current(0)
+        {
+            if(batchRows <= 0) {
+                throw Format("error in %s: %d, invalid batch rows %ld", __FUNCTION__, __LINE__, batchRows);
+            }
+            if(fileName == NULL || strcmp(fileName, "-") == 0) {
+                this->File = stdin;
+            } else {
+                this->File = fopen(fileName, "rb");
+                if(this->File == NULL) {
+                    throw Format("error in %s: %d, %s open failed.", __FUNCTION__, __LINE__, fileName);
+                }
+                this->OwnFile = true;
+            }
+        }
+        ~BatchReader() {
+            if(this->Pending.valid()) {
+                this->Pending.wait();
+            }
+            for(int i = 0; i < 2; i += 1) {
+                if(this->Buffer[i].Value != NULL) {
+                    this->Buffer[i].Release();
+                }
+            }
+            free(this->Line);
+            if(this->OwnFile) {
+                fclose(this->File);
+            }
+        }
+        BatchReader(const BatchReader&) = delete;
+        BatchReader& operator=(const BatchReader&) = delete;
+        
+        long int CountCells(const char* p, const char* end) {
+            long int cols = 0;
+            while(p < end) {
+                const char* cellEnd = (const char*)memchr(p, this->Delimiter, end - p);
+                cols += 1;
+                p = (cellEnd == NULL) ? end : cellEnd + 1;
+            }
+            return cols;
+        }
+        
+        const char* ParseLine(const char* cell, const char* end, double* dst) {
+            for(long int n = 0; n < this->Cols; n += 1) {
+                if(cell > end) {
+                    return NULL;
+                }
+                const char* cellEnd = (const char*)memchr(cell, this->Delimiter, end - cell);
+                if(cellEnd == NULL) {
+                    cellEnd = end;
+                }
+                if(ParseCell(cell, cellEnd, &dst[n]) == NULL) {
+                    return NULL;
+                }
+                cell = cellEnd + 1;
+            }
+            return cell;
+        }
+        
+        // Parse lines into Buffer[index] from row m up to BatchRows; returns the number of rows filled.
+        // Touches only the file and the buffer, so it can run on the read-ahead thread.
+        long int Fill(int index, long int m = 0) {
+            auto dst = this->Buffer[index];
+            while(m < this->BatchRows) {
+                ssize_t length = getline(&this->Line, &this->LineSize, this->File);
+                if(length < 0) {
+                    break;
+                }
+                const char* end = this->Line + length;
+                if(length > 0 && end[-1] == '\n') {
+                    end -= 1;
+                }
+                if(end == this->Line) {
+                    continue;
+                }
+                const char* rest = this->ParseLine(this->Line, end, dst[m]);
+                if(rest == NULL) {
+                    throw Format("error in %s: %d, parse failed at row %ld", __FUNCTION__, __LINE__, this->RowsRead);
+                }
+                if(rest < end) {
+                    throw Format("error in %s: %d, different column size at row %ld", __FUNCTION__, __LINE__, this->RowsRead);
+                }
+                this->RowsRead += 1;
+                m += 1;
+            }
+            return m;
+        }
+        
+        // The first line decides the column count, so the buffers are allocated here on the caller's thread.
+        long int FillFirst() {
+            ssize_t length;
+            while((length = getline(&this->Line, &this->LineSize, this->File)) >= 0) {
+                const char* end = this->Line + length;
+                if(length > 0 && end[-1] == '\n') {
+                    end -= 1;
+                }
+                if(end == this->Line) {
+                    continue;
+                }
+                this->Cols = this->CountCells(this->Line, end);
+                for(int i = 0; i < (this->ReadAhead ? 2 : 1); i += 1) {
+                    this->Buffer[i].Row = this->BatchRows;
+                    this->Buffer[i].Col = this->Cols;
+                    this->Buffer[i].Value = (double*)this->mm.Alloc(sizeof(double) * this->BatchRows * this->Cols);
+                }
+                if(this->ParseLine(this->Line, end, this->Buffer[0][0]) == NULL) {
+                    throw Format("error in %s: %d, parse failed at row 0", __FUNCTION__, __LINE__);
+                }
+                this->RowsRead = 1;
+                return this->Fill(0, 1);
+            }
+            return 0;
+        }
+        
+        // Returns the next batch, or a batch with Row == 0 at the end of the input.
+        Num2D<double> Next() {
+            long int rows;
+            int index = this->Current;
+            if(this->Cols == 0) {
+                rows = this->FillFirst();
+            } else if(this->Pending.valid()) {
+                rows = this->Pending.get();
+            } else {
+                rows = this->Fill(index);
+            }
+            if(rows == 0) {
+                return Num2D<double>(this->mm);
+            }
+            if(this->ReadAhead && rows == this->BatchRows) {
+                this->Current ^= 1;
+                this->Pending = std::async(std::launch::async, &BatchReader::Fill, this, this->Current, 0L);
+            }
+            return Num2D<double>(this->mm, rows, this->Cols, this->Buffer[index].Value);
+        }
+    };
 };